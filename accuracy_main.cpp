@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "helper.hpp"
+#include "config.hpp"
+#include "initial_conditions.hpp"
+#include "output_file.hpp"
+#include "simulation.hpp"
+
+/* Accuracy against cost of the octree solver.
+ *
+ * Compares simulation::tree_accelerations() with the direct O(N^2) summation for every combination
+ * of --proximity (cell_proximity_factor) and --limits (cell_particles_limit) on one seeded scene,
+ * next to the time per step of the same setting. Rows on the Pareto front of normalized error
+ * against time per step are marked. Besides the options below, every key of the simulation
+ * config is accepted. */
+namespace
+{
+	/* Acceleration of each particle, sorted by position so that trees of any shape line up. */
+	using sample = std::pair<vec3<double>, vec3<double>>;
+
+	std::vector<sample> sorted_by_position(const simulation &sim, const std::vector<vec3<double>> &accelerations)
+	{
+		std::vector<sample> samples;
+		samples.reserve(accelerations.size());
+		size_t index = 0;
+		sim.for_each_particle_block([&](const particle *block, const size_t &num)
+		{
+			for (size_t i = 0; i < num; ++i)
+			{
+				samples.emplace_back(block[i].pos, accelerations[index++]);
+			}
+		});
+
+		std::sort(samples.begin(), samples.end(), [](const sample &a, const sample &b)
+		{
+			return std::tie(a.first.x, a.first.y, a.first.z) < std::tie(b.first.x, b.first.y, b.first.z);
+		});
+		return samples;
+	}
+
+	struct result
+	{
+		double proximity = 0;
+		size_t limit = 0;
+		double ms_per_step = 0;
+		double interactions_ms = 0;
+		double tree_ms = 0;
+		size_t num_leafs = 0;
+		uint64_t pair_interactions = 0;
+		uint64_t cell_interactions = 0;
+		double rms_relative = 0;
+		double p99_relative = 0;
+		double max_relative = 0;
+		/* RMS error over RMS acceleration, robust to particles with vanishing force. */
+		double normalized_rms = 0;
+		bool pareto = false;
+	};
+}
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		using clock = std::chrono::steady_clock;
+
+		std::string out = "particles_accuracy.csv";
+		std::string proximity = "1,1.5,2,3";
+		std::string limits = "16,48,128";
+		std::string steps = "5";
+
+		std::vector<const char *> args(argv, argv + argc);
+		config::extract_options(args, {{"out", &out}, {"proximity", &proximity}, {"limits", &limits}, {"steps", &steps}});
+
+		config cfg;
+		cfg.num_particles = 20000;
+		cfg.seed = config::default_seed;
+		cfg.load(static_cast<int>(args.size()), args.data());
+		if (cfg.help)
+		{
+			std::printf("Usage: %s [--out=<csv>] [--proximity=<factor,...>] [--limits=<n,...>] [--steps=<n>] [config options]\n\n", argv[0]);
+			config::print_usage(argv[0]);
+			return 0;
+		}
+
+		const std::vector<double> proximity_factors = config::parse_list<double>("proximity", proximity);
+		const std::vector<size_t> particle_limits = config::parse_list<size_t>("limits", limits);
+		const size_t num_steps = std::max<size_t>(std::stoull(steps), 1);
+
+		const std::vector<particle> particles = generate_scene(cfg);
+
+		std::vector<sample> reference;
+		{
+			simulation sim(cfg.sim);
+			sim.add_bulk(particles);
+			const auto t1 = clock::now();
+			reference = sorted_by_position(sim, sim.direct_accelerations());
+			const auto t2 = clock::now();
+			INFO("Direct summation of %zu particles in %f s", particles.size(), std::chrono::duration<double>(t2 - t1).count());
+		}
+
+		double reference_squared = 0;
+		for (const sample &s : reference)
+		{
+			reference_squared += s.second * s.second;
+		}
+
+		std::vector<result> results;
+		for (const size_t &limit : particle_limits)
+		{
+			for (const double &factor : proximity_factors)
+			{
+				result r;
+				r.proximity = factor;
+				r.limit = limit;
+
+				simulation::parameters params = cfg.sim;
+				params.cell_proximity_factor = factor;
+				params.cell_particles_limit = limit;
+				simulation sim(params);
+				sim.add_bulk(particles);
+
+				const auto t1 = clock::now();
+				const std::vector<sample> tree = sorted_by_position(sim, sim.tree_accelerations());
+				const auto t2 = clock::now();
+				r.tree_ms = std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+				std::vector<double> relative;
+				relative.reserve(tree.size());
+				double error_squared = 0;
+				for (size_t i = 0; i < tree.size(); ++i)
+				{
+					const vec3<double> error = tree[i].second - reference[i].second;
+					error_squared += error * error;
+					const double norm = std::sqrt(reference[i].second * reference[i].second);
+					if (norm > 0)
+					{
+						relative.push_back(std::sqrt(error * error) / norm);
+					}
+				}
+				std::sort(relative.begin(), relative.end());
+				double relative_squared = 0;
+				for (const double &e : relative)
+				{
+					relative_squared += e * e;
+				}
+				if (!relative.empty())
+				{
+					r.rms_relative = std::sqrt(relative_squared / relative.size());
+					r.p99_relative = relative[std::min(relative.size() - 1, relative.size() * 99 / 100)];
+					r.max_relative = relative.back();
+				}
+				r.normalized_rms = std::sqrt(error_squared / std::max(reference_squared, 1e-300));
+
+				/* Cost in production: full steps on the worker pool, far field included. */
+				sim.step(1);
+				const simulation::step_timings timings = sim.step(num_steps);
+				const simulation::step_stats stats = simulation::average_step_stats(sim.get_step_stats(num_steps));
+				r.ms_per_step = timings.total / timings.steps * 1000;
+				r.interactions_ms = stats.phases[simulation::phase_interactions] * 1000;
+				r.num_leafs = stats.num_leafs;
+				r.pair_interactions = stats.particle_interactions;
+				r.cell_interactions = stats.cell_interactions;
+
+				INFO("cell_particles_limit %zu, cell_proximity_factor %g: %.3f ms/step, rms relative error %.3e, max %.3e, normalized rms %.3e",
+				     limit, factor, r.ms_per_step, r.rms_relative, r.max_relative, r.normalized_rms);
+				results.push_back(r);
+			}
+		}
+
+		for (result &r : results)
+		{
+			r.pareto = std::none_of(results.begin(), results.end(), [&r](const result &o)
+			{
+				return o.ms_per_step <= r.ms_per_step && o.normalized_rms <= r.normalized_rms &&
+				       (o.ms_per_step < r.ms_per_step || o.normalized_rms < r.normalized_rms);
+			});
+		}
+
+		std::string csv = "cell_particles_limit,cell_proximity_factor,ms_per_step,interactions_ms,tree_force_ms,num_leafs,pair_interactions,"
+		                  "cell_interactions,rms_relative_error,p99_relative_error,max_relative_error,normalized_rms_error,pareto\n";
+		for (const result &r : results)
+		{
+			char line[512];
+			std::snprintf(line, sizeof(line), "%zu,%g,%.4f,%.4f,%.4f,%zu,%llu,%llu,%.6e,%.6e,%.6e,%.6e,%d\n", r.limit, r.proximity, r.ms_per_step,
+			              r.interactions_ms, r.tree_ms, r.num_leafs, static_cast<unsigned long long>(r.pair_interactions),
+			              static_cast<unsigned long long>(r.cell_interactions), r.rms_relative, r.p99_relative, r.max_relative, r.normalized_rms,
+			              r.pareto ? 1 : 0);
+			csv += line;
+		}
+
+		output_file file(out, false);
+		file.write(csv.data(), csv.size());
+		file.close();
+		INFO("Results written to '%s'", out.c_str());
+	}
+	catch(const std::exception &ex)
+	{
+		ERROR("%s", ex.what());
+		return -1;
+	}
+
+	return 0;
+}
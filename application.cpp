@@ -1,7 +1,15 @@
+#include <thread>
+
 #include "application.hpp"
+#include "initial_conditions.hpp"
+#include "checkpoint.hpp"
+#include "tracer.hpp"
 
 void application::init()
 {
+	tracer::enable(!m_config.trace.empty());
+	tracer::set_thread_name("renderer");
+
 	m_wnd = window("particle_sim", 600, 600, false);
 
 	m_wnd.set_key_callback([this](const int &key, const int &scancode, const int &action, const int &mods)
@@ -16,37 +24,39 @@ void application::init()
 	m_wnd.set_scroll_callback([this](const double &xoffset, const double &yoffset)
 							  { window_scroll_callback(xoffset, yoffset); });
 
-	m_simulation = std::make_unique<simulation>(sim_size, num_threads, dt, particle_size, g_const, wall_collision_cor, collision_max_force, drag_factor, cell_particles_limit, cell_proximity_factor);
+	size_t num_threads = m_config.sim.num_threads;
+	if (num_threads == 0)
+	{
+		/* Leave one hardware thread to the render loop. */
+		num_threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	}
+
+	if (!m_config.restart.empty())
+	{
+		m_simulation = load_checkpoint(m_config.restart, num_threads);
+	}
+	else
+	{
+		simulation::parameters params = m_config.sim;
+		params.num_threads = num_threads;
+		m_simulation = std::make_unique<simulation>(params);
 
-	generate_particles();
+		generate_particles();
+	}
 
 	m_wnd.make_context_current();
-	m_renderer = particle_renderer(&m_wnd, m_simulation.get(), particle_scale, degrees_to_radians(fov));
+	m_simulation->set_render_snapshot_enabled(true);
+	m_simulation->set_stats_log_interval(m_config.stats_log_interval);
+	m_simulation->set_perf_counters_enabled(m_config.perf_counters);
+	m_renderer = particle_renderer(&m_wnd, m_simulation.get(), m_config.particle_scale, degrees_to_radians(m_config.fov), m_config.lod_threshold,
+	                               m_config.extrapolate);
 
 	m_cursor.pos = m_wnd.get_cursor_pos();
 }
 
 void application::generate_particles()
 {
-	for (size_t i = 0; i < num_particles; ++i)
-	{
-		/* Uniform points distribution inside the volume of a sphere:
-		 * https://math.stackexchange.com/questions/87230/picking-random-points-in-the-volume-of-sphere-with-uniform-probability
-		 */
-		const double x = normal_random_double(0, 1);
-		const double y = normal_random_double(0, 1);
-		const double z = normal_random_double(0, 1);
-		const double r = uniform_random_double(0, 1);
-
-		particle p;
-		p.pos = {x, y, z};
-		p.pos = p.pos / sqrt(p.pos * p.pos) * pow(r, 1.0 / 3);
-		p.pos = p.pos * (sim_size * 0.5 * generation_scale);
-
-		p.v = vec3<double>{p.pos.y, -p.pos.x, 0} * initial_velocity_factor;
-
-		m_simulation->add(p);
-	}
+	m_simulation->add_bulk(generate_scene(m_config));
 }
 
 void application::run()
@@ -54,16 +64,28 @@ void application::run()
 	m_simulation->start();
 	while (!m_wnd.should_close())
 	{
-		window::poll_events();
-
-		m_renderer.configure_pipeline();
-		m_renderer.render();
+		/* Frames are only drawn for new simulation steps or camera changes, otherwise the thread
+		 * sleeps and leaves the CPU to the simulation. */
+		window::wait_events(m_idle_wait);
+
+		if (m_renderer.needs_redraw())
+		{
+			tracer::scope scope("render");
+			m_renderer.configure_pipeline();
+			m_renderer.render();
+
+			m_wnd.swap_buffers();
+		}
+	}
 
-		m_wnd.swap_buffers();
+	if (!m_config.trace.empty())
+	{
+		m_simulation->stop();
+		tracer::write(m_config.trace);
 	}
 }
 
-application::application()
+application::application(const config &cfg) : m_config(cfg)
 {
 	init();
 }
@@ -2,27 +2,16 @@
 #include <atomic>
 
 #include "simulation.hpp"
+#include "config.hpp"
 #include "window.hpp"
 #include "particle_renderer.hpp"
 
 class application
 {
 private:
-	static constexpr double sim_size = 100.;
-	static constexpr double g_const = 0.02;
-	static constexpr double particle_size = 0.4;
-	static constexpr double dt = 0.005;
-	static constexpr double drag_factor = 0.05;
-	static constexpr double collision_max_force = 2;
-	static constexpr double initial_velocity_factor = 0.04;
-	static constexpr size_t num_particles = 32000;
-	static constexpr size_t cell_particles_limit = 48;
-	static constexpr double wall_collision_cor = 0.0;
-	static constexpr double generation_scale = 1.;
-	static constexpr size_t num_threads = 7;
-	static constexpr double cell_proximity_factor = 1.5;
-	static constexpr float particle_scale = 1.;
-	static constexpr float fov = 70;
+	const config m_config;
+	/* Seconds to wait for input between checks for a new simulation step. */
+	static constexpr double m_idle_wait = 0.004;
 
 	/* I don't want to make it DefaultConstructible because I'm lazy. */
 	std::unique_ptr<simulation> m_simulation;
@@ -43,7 +32,7 @@ private:
 	void window_scroll_callback(const double &xoffset, const double &yoffset);
 
 public:
-	application();
+	application(const config &cfg);
 	~application();
 
 	void run();
@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "helper.hpp"
+#include "config.hpp"
+#include "initial_conditions.hpp"
+#include "output_file.hpp"
+#include "simulation.hpp"
+
+/* Microbenchmarks of the force kernels and tree operations on a seeded scene.
+ *
+ * Every benchmark runs a fixed amount of work, once to warm up and then repetitions times, and
+ * reports nanoseconds per operation. Only the timed body is measured, setup runs in between.
+ * Besides --out, --repetitions and --filter, every key of the simulation config is accepted. */
+struct simulation_bench
+{
+	using clock = std::chrono::steady_clock;
+	using cell = simulation::cell;
+
+	struct result
+	{
+		std::string name;
+		size_t ops = 0;
+		std::vector<double> ns_per_op;
+	};
+
+	const config &m_config;
+	const size_t m_repetitions;
+	const std::string m_filter;
+	std::vector<particle> m_particles;
+	std::unique_ptr<simulation> m_simulation;
+	std::vector<result> m_results;
+	size_t m_num_leafs = 0;
+	/* Keeps the results of the kernels alive. */
+	volatile double m_sink = 0;
+
+	simulation_bench(const config &cfg, const size_t &repetitions, const std::string &filter) :
+		m_config(cfg), m_repetitions(std::max<size_t>(repetitions, 1)), m_filter(filter)
+	{
+		m_particles = generate_scene(m_config);
+		m_simulation = std::make_unique<simulation>(m_config.sim);
+		m_simulation->add_bulk(m_particles);
+		m_simulation->m_leafs.clear();
+		m_simulation->m_root.find_leafs(m_simulation->m_leafs);
+		for (cell *c : m_simulation->m_leafs)
+		{
+			c->calculate_center_of_mass();
+		}
+		m_num_leafs = m_simulation->m_leafs.size();
+	}
+
+	template <typename Setup, typename F>
+	void run(const char *name, const size_t &ops, Setup &&setup, F &&body)
+	{
+		if (!m_filter.empty() && std::strstr(name, m_filter.c_str()) == nullptr)
+		{
+			return;
+		}
+
+		result r{name, std::max<size_t>(ops, 1), {}};
+		for (size_t i = 0; i <= m_repetitions; ++i)
+		{
+			setup();
+			const auto t1 = clock::now();
+			body();
+			const auto t2 = clock::now();
+			/* The first run only warms up. */
+			if (i > 0)
+			{
+				r.ns_per_op.push_back(std::chrono::duration<double, std::nano>(t2 - t1).count() / r.ops);
+			}
+		}
+
+		std::vector<double> sorted = r.ns_per_op;
+		std::sort(sorted.begin(), sorted.end());
+		INFO("%-28s %12.2f ns/op (min %.2f), %zu ops", name, sorted[sorted.size() / 2], sorted.front(), r.ops);
+		m_results.push_back(std::move(r));
+	}
+
+	void run_all()
+	{
+		simulation &sim = *m_simulation;
+		std::vector<cell *> &leafs = sim.m_leafs;
+		const auto no_setup = [] {};
+
+		/* Pairs within each leaf, the mix of contacts and gravity the workers see. */
+		size_t num_pairs = 0;
+		for (const cell *c : leafs)
+		{
+			num_pairs += c->m_particles.size() * (c->m_particles.size() - 1) / 2;
+		}
+		run("particle_pair_interaction", num_pairs, no_setup, [&]
+		{
+			vec3<double> sum = {};
+			for (const cell *c : leafs)
+			{
+				const std::vector<particle> &p = c->m_particles;
+				for (size_t k = 0; k < p.size(); ++k)
+				{
+					for (size_t l = k + 1; l < p.size(); ++l)
+					{
+						sum = sum + sim.particle_pair_interaction(p[k], p[l]);
+					}
+				}
+			}
+			m_sink = sum.x + sum.y + sum.z;
+		});
+
+		run("calculate_center_of_mass", m_particles.size(), no_setup, [&]
+		{
+			for (cell *c : leafs)
+			{
+				c->calculate_center_of_mass();
+			}
+		});
+
+		const size_t num_sources = std::min<size_t>(leafs.size(), 256);
+		run("cell_pair_interaction", num_sources * (leafs.size() - 1), no_setup, [&]
+		{
+			for (size_t i = 0; i < num_sources; ++i)
+			{
+				cell &c1 = *leafs[i];
+				for (size_t j = 0; j < leafs.size(); ++j)
+				{
+					if (j != i)
+					{
+						sim.cell_pair_interaction(c1, *leafs[j]);
+					}
+				}
+				m_sink = c1.m_a.x;
+				c1.m_surrounding_cells.clear();
+				c1.m_a = {};
+			}
+		});
+
+		std::vector<cell *> found;
+		run("find_leafs", leafs.size(), no_setup, [&]
+		{
+			found.clear();
+			sim.m_root.find_leafs(found);
+		});
+
+		std::vector<simulation::render_vertex> vertices(m_particles.size());
+		simulation::render_node node;
+		run("export_render_leaf", m_particles.size(), no_setup, [&]
+		{
+			simulation::render_vertex *v = vertices.data();
+			for (const cell *c : leafs)
+			{
+				simulation::export_render_leaf(c->m_particles, v, node);
+				v += c->m_particles.size();
+			}
+			m_sink = node.center_of_mass.x;
+		});
+
+		std::unique_ptr<cell> tree;
+		const auto new_tree = [&]
+		{
+			tree.reset();
+			tree = std::make_unique<cell>(nullptr, sim.m_root.m_cube, sim.m_root.m_particles_limit);
+		};
+		run("cell_add", m_particles.size(), new_tree, [&]
+		{
+			for (const particle &p : m_particles)
+			{
+				tree->add(p);
+			}
+		});
+
+		/* Splits every leaf of a fresh tree once, re-adding its particles to the children. */
+		std::vector<cell *> split;
+		run("cell_subdivide", leafs.size(), [&]
+		{
+			new_tree();
+			for (const particle &p : m_particles)
+			{
+				tree->add(p);
+			}
+			split.clear();
+			tree->find_leafs(split);
+		}, [&]
+		{
+			for (cell *c : split)
+			{
+				c->subdivide();
+			}
+		});
+		tree.reset();
+
+		/* Particles move by one step of their velocity before each run, as between two steps. */
+		const auto drift = [&]
+		{
+			for (cell *c : leafs)
+			{
+				for (particle &p : c->m_particles)
+				{
+					p.pos = p.pos + p.v * m_config.sim.dt;
+				}
+			}
+		};
+		const auto refresh_leafs = [&]
+		{
+			leafs.clear();
+			sim.m_root.find_leafs(leafs);
+		};
+		run("propagate_particles_up", m_particles.size(), [&]
+		{
+			sim.m_root.propagate_particles_down();
+			refresh_leafs();
+			drift();
+		}, [&]
+		{
+			sim.m_root.propagate_particles_up(sim.m_temp_particles);
+		});
+		sim.m_root.propagate_particles_down();
+
+		run("propagate_particles_down", m_particles.size(), [&]
+		{
+			refresh_leafs();
+			drift();
+			sim.m_root.propagate_particles_up(sim.m_temp_particles);
+		}, [&]
+		{
+			sim.m_root.propagate_particles_down();
+		});
+		refresh_leafs();
+	}
+
+	void write_json(const std::string &path) const
+	{
+		std::string json = "{\n";
+		char line[512];
+		std::snprintf(line, sizeof(line), "  \"scene\": \"%s\",\n  \"num_particles\": %zu,\n  \"seed\": %zu,\n  \"cell_particles_limit\": %zu,\n"
+		              "  \"num_leafs\": %zu,\n  \"repetitions\": %zu,\n  \"benchmarks\": [",
+		              m_config.scene.c_str(), m_particles.size(), m_config.seed, m_config.sim.cell_particles_limit,
+		              m_num_leafs, m_repetitions);
+		json += line;
+
+		for (size_t i = 0; i < m_results.size(); ++i)
+		{
+			const result &r = m_results[i];
+			std::vector<double> sorted = r.ns_per_op;
+			std::sort(sorted.begin(), sorted.end());
+			std::snprintf(line, sizeof(line), "%s\n    {\"name\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.4f, \"ns_per_op_min\": %.4f, \"samples\": [",
+			              i == 0 ? "" : ",", r.name.c_str(), r.ops, sorted[sorted.size() / 2], sorted.front());
+			json += line;
+			for (size_t j = 0; j < r.ns_per_op.size(); ++j)
+			{
+				std::snprintf(line, sizeof(line), "%s%.4f", j == 0 ? "" : ", ", r.ns_per_op[j]);
+				json += line;
+			}
+			json += "]}";
+		}
+		json += "\n  ]\n}\n";
+
+		output_file file(path, false);
+		file.write(json.data(), json.size());
+		file.close();
+		INFO("Results written to '%s'", path.c_str());
+	}
+};
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		std::string out = "particles_bench.json";
+		std::string repetitions = "5";
+		std::string filter;
+
+		/* The bench options are taken out, the rest goes to the config. */
+		std::vector<const char *> args(argv, argv + argc);
+		config::extract_options(args, {{"out", &out}, {"repetitions", &repetitions}, {"filter", &filter}});
+
+		config cfg;
+		cfg.num_particles = 100000;
+		cfg.seed = config::default_seed;
+		cfg.load(static_cast<int>(args.size()), args.data());
+		if (cfg.help)
+		{
+			std::printf("Usage: %s [--out=<json>] [--repetitions=<n>] [--filter=<substring>] [config options]\n\n", argv[0]);
+			config::print_usage(argv[0]);
+			return 0;
+		}
+
+		simulation_bench bench(cfg, std::stoull(repetitions), filter);
+		bench.run_all();
+		bench.write_json(out);
+	}
+	catch(const std::exception &ex)
+	{
+		ERROR("%s", ex.what());
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "helper.hpp"
+#include "checkpoint.hpp"
+#include "config.hpp"
+#include "endian.hpp"
+#include "initial_conditions.hpp"
+#include "output_file.hpp"
+#include "simulation.hpp"
+#include "snapshot_writer.hpp"
+
+/* Regression checks of behaviour the harnesses don't exercise.
+ *
+ * Every check throws on failure. All checks run unless --filter selects those whose name contains
+ * the given substring, and the exit code is non-zero if any failed. Files are written to --dir,
+ * the system's temporary directory by default. */
+namespace
+{
+	struct check
+	{
+		const char *name;
+		std::function<void(const std::filesystem::path &dir)> run;
+	};
+
+	std::unique_ptr<simulation> small_simulation()
+	{
+		config cfg;
+		cfg.num_particles = 500;
+		cfg.seed = config::default_seed;
+		cfg.sim.num_threads = 2;
+		auto sim = std::make_unique<simulation>(cfg.sim);
+		sim->add_bulk(generate_scene(cfg));
+		return sim;
+	}
+
+	std::vector<unsigned char> read_file(const std::string &path)
+	{
+		std::FILE *const file = std::fopen(path.c_str(), "rb");
+		ASSERT_EX_M_PRINTF(file != nullptr, "Failed to open '%s'", path.c_str());
+		std::vector<unsigned char> data;
+		unsigned char buffer[65536];
+		size_t read;
+		while ((read = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+		{
+			data.insert(data.end(), buffer, buffer + read);
+		}
+		std::fclose(file);
+		return data;
+	}
+
+	void write_file(const std::string &path, const void *data, const size_t &size)
+	{
+		output_file file(path, false);
+		file.write(data, size);
+		file.close();
+	}
+
+	/* Passes if f throws. */
+	template <typename F>
+	void expect_throw(const char *what, F &&f)
+	{
+		try
+		{
+			f();
+		}
+		catch (const std::exception &)
+		{
+			return;
+		}
+		THROW_PRINTF("%s was accepted", what);
+	}
+
+	void checkpoint_truncated(const std::filesystem::path &dir)
+	{
+		const std::string path = (dir / "check_truncated.ckpt").string();
+		save_checkpoint(*small_simulation(), path);
+		const std::vector<unsigned char> data = read_file(path);
+		ASSERT_EX_M(load_checkpoint(path, 1)->get_num_particles() == 500, "The complete checkpoint didn't load");
+
+		/* Within the last header field, one byte short of the header, and within the records. */
+		for (const size_t &size : {sizeof(checkpoint_header) - sizeof(uint64_t) + 4, sizeof(checkpoint_header) - 1, data.size() - 1})
+		{
+			write_file(path, data.data(), size);
+			char what[64];
+			std::snprintf(what, sizeof(what), "A checkpoint truncated to %zu bytes", size);
+			expect_throw(what, [&] { load_checkpoint(path, 1); });
+		}
+		std::filesystem::remove(path);
+	}
+
+	/* Header fields that config::load would reject must not be loaded from a checkpoint either. */
+	void checkpoint_invalid_parameters(const std::filesystem::path &dir)
+	{
+		const std::string path = (dir / "check_invalid.ckpt").string();
+		save_checkpoint(*small_simulation(), path);
+		const std::vector<unsigned char> data = read_file(path);
+
+		const auto corrupt = [&](const char *what, const size_t &offset, const auto &value)
+		{
+			std::vector<unsigned char> corrupted = data;
+			const auto stored = to_little_endian(value);
+			std::memcpy(corrupted.data() + offset, &stored, sizeof(stored));
+			write_file(path, corrupted.data(), corrupted.size());
+			expect_throw(what, [&] { load_checkpoint(path, 1); });
+		};
+		corrupt("cell_particles_limit 0", offsetof(checkpoint_header, cell_particles_limit), uint64_t{0});
+		corrupt("size 0", offsetof(checkpoint_header, size), 0.);
+		corrupt("dt -1", offsetof(checkpoint_header, dt), -1.);
+		corrupt("particle_size NaN", offsetof(checkpoint_header, particle_size), std::nan(""));
+		std::filesystem::remove(path);
+	}
+
+	std::vector<vec3<double>> positions(const simulation &sim)
+	{
+		std::vector<vec3<double>> result;
+		sim.for_each_particle_block([&](const particle *block, const size_t &num)
+		{
+			for (size_t i = 0; i < num; ++i)
+			{
+				result.push_back(block[i].pos);
+			}
+		});
+		return result;
+	}
+
+	/* RMS distance to the nearest reference position, particles carry no identity. */
+	double rms_distance(const std::vector<vec3<double>> &positions, const std::vector<vec3<double>> &reference)
+	{
+		double sum = 0;
+		for (const vec3<double> &p : positions)
+		{
+			double nearest = std::numeric_limits<double>::max();
+			for (const vec3<double> &r : reference)
+			{
+				nearest = std::min(nearest, (p - r) * (p - r));
+			}
+			sum += nearest;
+		}
+		return std::sqrt(sum / std::max<size_t>(positions.size(), 1));
+	}
+
+	/* Changing far_field_interval mid-run must apply every dt of far field exactly once. A lost or
+	 * doubled half-kick at a switch is first order in dt and would outweigh the splitting error of
+	 * running with the larger interval throughout. Uses the scene of particles_convergence, where
+	 * the far field is exact. */
+	void far_field_interval_switch(const std::filesystem::path &)
+	{
+		config cfg;
+		cfg.num_particles = 64;
+		cfg.seed = config::default_seed;
+		cfg.generation_scale = 0.5;
+		cfg.sim.num_threads = 2;
+		cfg.sim.dt = 0.05;
+		cfg.sim.particle_size = 0.01;
+		cfg.sim.cell_particles_limit = 1;
+		const std::vector<particle> particles = generate_scene(cfg);
+
+		/* 8 steps per entry, a multiple of every interval, so each change takes effect at once. */
+		const auto run = [&](const std::vector<size_t> &intervals)
+		{
+			simulation sim(cfg.sim);
+			sim.add_bulk(particles);
+			for (const size_t &interval : intervals)
+			{
+				sim.set_far_field_interval(interval);
+				sim.step(8);
+			}
+			return positions(sim);
+		};
+		const std::vector<vec3<double>> reference = run({1, 1, 1, 1, 1, 1});
+		const double constant_error = rms_distance(run({4, 4, 4, 4, 4, 4}), reference);
+		const double switched_error = rms_distance(run({1, 4, 4, 1, 4, 1}), reference);
+		ASSERT_EX_M_PRINTF(switched_error <= constant_error, "Switching the interval between 1 and 4 deviates by %.3e, constant 4 by %.3e",
+		                   switched_error, constant_error);
+	}
+
+	/* A timestep controller set before a step takes effect at the end of that step. */
+	void timestep_control_first_step(const std::filesystem::path &)
+	{
+		const std::unique_ptr<simulation> sim = small_simulation();
+		const double dt = sim->get_dt() * 0.5;
+		simulation::timestep_control control;
+		control.enabled = true;
+		control.dt_min = dt;
+		control.dt_max = dt;
+		sim->set_timestep_control(control);
+		sim->step(1);
+		ASSERT_EX_M_PRINTF(sim->get_dt() == dt, "dt is %g after the first step, expected %g", sim->get_dt(), dt);
+	}
+
+	/* Snapshots the consumer throws on are counted as failed, not written. */
+	void snapshot_writer_failures(const std::filesystem::path &)
+	{
+		snapshot_writer writer(2, 1, snapshot_writer::overflow_policy::block,
+			[](const std::vector<vec3<double>> &, const uint64_t &step, const double &)
+			{
+				ASSERT_EX_M(step % 2 == 0, "Odd step");
+			});
+		for (uint64_t step = 0; step < 6; ++step)
+		{
+			std::vector<vec3<double>> positions(1);
+			writer.submit(positions, step, 0);
+		}
+		writer.flush();
+		ASSERT_EX_M_PRINTF(writer.get_written() == 3 && writer.get_failed() == 3 && writer.get_dropped() == 0,
+		                   "%zu written, %zu failed, %zu dropped, expected 3, 3 and 0", writer.get_written(), writer.get_failed(),
+		                   writer.get_dropped());
+	}
+
+	const check checks[] = {
+		{"checkpoint_truncated", checkpoint_truncated},
+		{"checkpoint_invalid_parameters", checkpoint_invalid_parameters},
+		{"far_field_interval_switch", far_field_interval_switch},
+		{"timestep_control_first_step", timestep_control_first_step},
+		{"snapshot_writer_failures", snapshot_writer_failures},
+	};
+}
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		std::string dir = std::filesystem::temp_directory_path().string();
+		std::string filter;
+
+		std::vector<const char *> args(argv, argv + argc);
+		config::extract_options(args, {{"dir", &dir}, {"filter", &filter}});
+		ASSERT_EX_M(args.size() == 1, "Usage: particles_check [--dir=<directory>] [--filter=<substring>]");
+
+		size_t failed = 0;
+		for (const check &c : checks)
+		{
+			if (!filter.empty() && std::strstr(c.name, filter.c_str()) == nullptr)
+			{
+				continue;
+			}
+			try
+			{
+				c.run(dir);
+				INFO("%-32s passed", c.name);
+			}
+			catch (const std::exception &ex)
+			{
+				ERROR("%-32s failed: %s", c.name, ex.what());
+				++failed;
+			}
+		}
+
+		ASSERT_EX_M_PRINTF(failed == 0, "%zu checks failed", failed);
+	}
+	catch(const std::exception &ex)
+	{
+		ERROR("%s", ex.what());
+		return -1;
+	}
+
+	return 0;
+}
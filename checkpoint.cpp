@@ -0,0 +1,279 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CHECKPOINT_MMAP
+#endif
+
+#include "checkpoint.hpp"
+#include "endian.hpp"
+#include "helper.hpp"
+
+static_assert(sizeof(checkpoint_header) % 8 == 0, "Checkpoint header must keep the records 8-byte aligned");
+
+namespace
+{
+	constexpr size_t record_doubles = 6;
+	constexpr size_t record_size = record_doubles * sizeof(double);
+	constexpr size_t write_chunk_size = 4 << 20;
+
+	void byteswap_header(checkpoint_header &h)
+	{
+		h.version = to_little_endian(h.version);
+		h.header_size = to_little_endian(h.header_size);
+		/* Every field after header_size is 8 bytes wide. */
+		unsigned char *const begin = reinterpret_cast<unsigned char *>(&h.num_particles);
+		const size_t num = (sizeof(checkpoint_header) - offsetof(checkpoint_header, num_particles)) / 8;
+		for (size_t i = 0; i < num; ++i)
+		{
+			uint64_t field;
+			std::memcpy(&field, begin + i * 8, 8);
+			field = to_little_endian(field);
+			std::memcpy(begin + i * 8, &field, 8);
+		}
+	}
+
+	struct mapped_file
+	{
+		const unsigned char *data = nullptr;
+		size_t size = 0;
+#ifdef CHECKPOINT_MMAP
+		void *mapping = MAP_FAILED;
+#else
+		std::vector<unsigned char> buffer;
+#endif
+
+		explicit mapped_file(const std::string &path)
+		{
+#ifdef CHECKPOINT_MMAP
+			const int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+			{
+				THROW_PRINTF("Failed to open checkpoint '%s'", path.c_str());
+			}
+
+			struct stat st;
+			if (fstat(fd, &st) != 0 || st.st_size == 0)
+			{
+				close(fd);
+				THROW_PRINTF("Failed to read checkpoint '%s'", path.c_str());
+			}
+			size = static_cast<size_t>(st.st_size);
+
+			mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (mapping == MAP_FAILED)
+			{
+				THROW_PRINTF("Failed to map checkpoint '%s'", path.c_str());
+			}
+			madvise(mapping, size, MADV_SEQUENTIAL);
+			madvise(mapping, size, MADV_WILLNEED);
+			data = static_cast<const unsigned char *>(mapping);
+#else
+			std::FILE *const file = std::fopen(path.c_str(), "rb");
+			if (file == nullptr)
+			{
+				THROW_PRINTF("Failed to open checkpoint '%s'", path.c_str());
+			}
+			std::fseek(file, 0, SEEK_END);
+			buffer.resize(static_cast<size_t>(std::ftell(file)));
+			std::fseek(file, 0, SEEK_SET);
+			const size_t read = std::fread(buffer.data(), 1, buffer.size(), file);
+			std::fclose(file);
+			if (read != buffer.size())
+			{
+				THROW_PRINTF("Failed to read checkpoint '%s'", path.c_str());
+			}
+			data = buffer.data();
+			size = buffer.size();
+#endif
+		}
+
+		~mapped_file()
+		{
+#ifdef CHECKPOINT_MMAP
+			if (mapping != MAP_FAILED)
+			{
+				munmap(mapping, size);
+			}
+#endif
+		}
+
+		mapped_file(const mapped_file &) = delete;
+		mapped_file &operator=(const mapped_file &) = delete;
+	};
+}
+
+void save_checkpoint(const simulation &sim, const std::string &path)
+{
+	const simulation::parameters params = sim.get_parameters();
+	const simulation::integration_state state = sim.get_integration_state();
+
+	checkpoint_header h = {};
+	std::memcpy(h.magic, checkpoint_header::magic_value, sizeof(h.magic));
+	h.version = checkpoint_header::current_version;
+	h.header_size = sizeof(checkpoint_header);
+	h.num_particles = sim.get_num_particles();
+	h.size = params.size;
+	h.particle_size = params.particle_size;
+	h.g_const = params.g_const;
+	h.wall_collision_cor = params.wall_collision_cor;
+	h.collision_max_force = params.collision_max_force;
+	h.drag_factor = params.drag_factor;
+	h.cell_proximity_factor = params.cell_proximity_factor;
+	h.cell_particles_limit = params.cell_particles_limit;
+	h.far_field_interval = params.far_field_interval;
+	h.adaptive_dt = params.timestep.enabled;
+	h.dt_min = params.timestep.dt_min;
+	h.dt_max = params.timestep.dt_max;
+	h.dt_accel_factor = params.timestep.accel_factor;
+	h.dt_velocity_factor = params.timestep.velocity_factor;
+	h.dt_hysteresis = params.timestep.hysteresis;
+	h.dt_max_growth = params.timestep.max_growth;
+	h.sim_time = state.sim_time;
+	h.dt = state.dt;
+	h.prev_substep_dt = state.prev_substep_dt;
+	h.far_field_elapsed = state.far_field_elapsed;
+	h.far_field_countdown = state.far_field_countdown;
+	h.step = state.step;
+	byteswap_header(h);
+
+	const std::string tmp_path = path + ".tmp";
+	std::FILE *const file = std::fopen(tmp_path.c_str(), "wb");
+	if (file == nullptr)
+	{
+		THROW_PRINTF("Failed to create checkpoint '%s'", tmp_path.c_str());
+	}
+	/* Records are staged in large chunks, stdio buffering would only add a copy. */
+	std::setvbuf(file, nullptr, _IONBF, 0);
+
+	bool ok = std::fwrite(&h, sizeof(h), 1, file) == 1;
+
+	std::vector<double> chunk;
+	chunk.reserve(write_chunk_size / sizeof(double));
+	const auto flush = [&]
+	{
+		ok = ok && std::fwrite(chunk.data(), sizeof(double), chunk.size(), file) == chunk.size();
+		chunk.clear();
+	};
+
+	size_t written = 0;
+	sim.for_each_particle_block([&](const particle *particles, const size_t &num)
+	{
+		for (size_t i = 0; i < num; ++i)
+		{
+			const particle &p = particles[i];
+			for (const double value : {p.pos.x, p.pos.y, p.pos.z, p.v.x, p.v.y, p.v.z})
+			{
+				chunk.push_back(to_little_endian(value));
+			}
+			if (chunk.size() + record_doubles > chunk.capacity())
+			{
+				flush();
+			}
+		}
+		written += num;
+	});
+	flush();
+
+	ok = std::fflush(file) == 0 && ok;
+	ok = std::fclose(file) == 0 && ok;
+	if (!ok || written != sim.get_num_particles())
+	{
+		std::remove(tmp_path.c_str());
+		THROW_PRINTF("Failed to write checkpoint '%s'", tmp_path.c_str());
+	}
+
+	if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+	{
+		THROW_PRINTF("Failed to move checkpoint to '%s'", path.c_str());
+	}
+}
+
+std::unique_ptr<simulation> load_checkpoint(const std::string &path, const size_t &num_threads)
+{
+	const mapped_file file(path);
+
+	checkpoint_header h;
+	if (file.size < sizeof(h))
+	{
+		THROW_PRINTF("'%s' is too small to be a checkpoint", path.c_str());
+	}
+	std::memcpy(&h, file.data, sizeof(h));
+	if (std::memcmp(h.magic, checkpoint_header::magic_value, sizeof(h.magic)) != 0)
+	{
+		THROW_PRINTF("'%s' is not a checkpoint", path.c_str());
+	}
+	byteswap_header(h);
+	if (h.version != checkpoint_header::current_version || h.header_size != sizeof(h))
+	{
+		THROW_PRINTF("Unsupported checkpoint version %u in '%s'", h.version, path.c_str());
+	}
+	if (file.size < h.header_size)
+	{
+		THROW_PRINTF("Checkpoint '%s' is truncated", path.c_str());
+	}
+	if ((file.size - h.header_size) / record_size < h.num_particles)
+	{
+		THROW_PRINTF("Checkpoint '%s' is truncated", path.c_str());
+	}
+
+	simulation::parameters params;
+	params.size = h.size;
+	params.num_threads = num_threads;
+	params.dt = h.dt;
+	params.particle_size = h.particle_size;
+	params.g_const = h.g_const;
+	params.wall_collision_cor = h.wall_collision_cor;
+	params.collision_max_force = h.collision_max_force;
+	params.drag_factor = h.drag_factor;
+	params.cell_particles_limit = h.cell_particles_limit;
+	params.cell_proximity_factor = h.cell_proximity_factor;
+	params.far_field_interval = h.far_field_interval;
+	params.timestep.enabled = h.adaptive_dt != 0;
+	params.timestep.dt_min = h.dt_min;
+	params.timestep.dt_max = h.dt_max;
+	params.timestep.accel_factor = h.dt_accel_factor;
+	params.timestep.velocity_factor = h.dt_velocity_factor;
+	params.timestep.hysteresis = h.dt_hysteresis;
+	params.timestep.max_growth = h.dt_max_growth;
+	try
+	{
+		simulation::validate_parameters(params);
+	}
+	catch (const std::exception &ex)
+	{
+		THROW_PRINTF("Checkpoint '%s' is corrupt: %s", path.c_str(), ex.what());
+	}
+
+	auto sim = std::make_unique<simulation>(params);
+
+	std::vector<particle> particles(h.num_particles);
+	const unsigned char *records = file.data + h.header_size;
+	for (particle &p : particles)
+	{
+		double values[record_doubles];
+		std::memcpy(values, records, record_size);
+		records += record_size;
+
+		p.pos = {from_little_endian(values[0]), from_little_endian(values[1]), from_little_endian(values[2])};
+		p.v = {from_little_endian(values[3]), from_little_endian(values[4]), from_little_endian(values[5])};
+	}
+	sim->add_bulk(particles);
+
+	simulation::integration_state state;
+	state.step = h.step;
+	state.sim_time = h.sim_time;
+	state.dt = h.dt;
+	state.prev_substep_dt = h.prev_substep_dt;
+	state.far_field_elapsed = h.far_field_elapsed;
+	state.far_field_countdown = h.far_field_countdown;
+	sim->set_integration_state(state);
+
+	return sim;
+}
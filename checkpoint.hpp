@@ -0,0 +1,53 @@
+#pragma once
+#include <memory>
+#include <string>
+
+#include "simulation.hpp"
+
+/* Versioned binary checkpoint of a stopped simulation.
+ *
+ * Layout, little-endian: a fixed-size checkpoint_header with the simulation parameters
+ * and integrator state, followed by num_particles records of six doubles (pos.xyz, v.xyz)
+ * in depth-first leaf order, so a restart loads spatially sorted particles.
+ * Accelerations are not stored; they are recomputed by the next step. */
+
+struct checkpoint_header
+{
+	static constexpr char magic_value[8] = {'P', 'S', 'I', 'M', 'C', 'K', 'P', 'T'};
+	static constexpr uint32_t current_version = 2;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t num_particles;
+	double size;
+	double particle_size;
+	double g_const;
+	double wall_collision_cor;
+	double collision_max_force;
+	double drag_factor;
+	double cell_proximity_factor;
+	uint64_t cell_particles_limit;
+	uint64_t far_field_interval;
+	uint64_t adaptive_dt;
+	double dt_min;
+	double dt_max;
+	double dt_accel_factor;
+	double dt_velocity_factor;
+	double dt_hysteresis;
+	double dt_max_growth;
+	double sim_time;
+	double dt;
+	double prev_substep_dt;
+	double far_field_elapsed;
+	uint64_t far_field_countdown;
+	uint64_t step;
+};
+
+/* Writes to path + ".tmp" and renames it over path, so an interrupted write never
+ * destroys the previous checkpoint. */
+void save_checkpoint(const simulation &sim, const std::string &path);
+
+/* Maps the checkpoint into memory and bulk-loads it. num_threads is not stored in the
+ * checkpoint since it depends on the machine the run is restarted on. */
+std::unique_ptr<simulation> load_checkpoint(const std::string &path, const size_t &num_threads);
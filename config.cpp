@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <variant>
+#include <vector>
+
+#include "config.hpp"
+#include "helper.hpp"
+
+namespace
+{
+	struct option
+	{
+		const char *key;
+		std::variant<double config::*, float config::*, size_t config::*, bool config::*, std::string config::*,
+		             double simulation::parameters::*, size_t simulation::parameters::*,
+		             double simulation::timestep_control::*, bool simulation::timestep_control::*> member;
+		const char *description;
+	};
+
+	const option options[] = {
+		{"size", &simulation::parameters::size, "Diameter of the simulation volume"},
+		{"num_threads", &simulation::parameters::num_threads, "Worker threads, 0 uses all hardware threads"},
+		{"dt", &simulation::parameters::dt, "Timestep, the initial one when adaptive_dt is set"},
+		{"particle_size", &simulation::parameters::particle_size, "Particle diameter"},
+		{"g_const", &simulation::parameters::g_const, "Gravitational constant"},
+		{"wall_collision_cor", &simulation::parameters::wall_collision_cor, "Coefficient of restitution of the wall"},
+		{"collision_max_force", &simulation::parameters::collision_max_force, "Maximum contact force"},
+		{"drag_factor", &simulation::parameters::drag_factor, "Contact drag factor"},
+		{"cell_particles_limit", &simulation::parameters::cell_particles_limit, "Maximum number of particles in an octree leaf"},
+		{"cell_proximity_factor", &simulation::parameters::cell_proximity_factor, "Distance, in cell sizes, below which cells interact per particle"},
+		{"far_field_interval", &simulation::parameters::far_field_interval, "Steps between far field evaluations (r-RESPA), 1 disables"},
+		{"adaptive_dt", &simulation::timestep_control::enabled, "Enable the adaptive timestep controller"},
+		{"dt_min", &simulation::timestep_control::dt_min, "Lower bound of the adaptive timestep"},
+		{"dt_max", &simulation::timestep_control::dt_max, "Upper bound of the adaptive timestep"},
+		{"dt_accel_factor", &simulation::timestep_control::accel_factor, "Acceleration criterion factor"},
+		{"dt_velocity_factor", &simulation::timestep_control::velocity_factor, "Relative velocity (Courant) criterion factor"},
+		{"dt_hysteresis", &simulation::timestep_control::hysteresis, "Fraction by which the target must exceed dt before it grows"},
+		{"dt_max_growth", &simulation::timestep_control::max_growth, "Maximum timestep growth factor per step"},
+		{"scene", &config::scene, "Generated initial conditions: sphere, plummer or disk"},
+		{"seed", &config::seed, "Seed of the generated initial conditions, 0 picks a random one"},
+		{"deterministic", &config::deterministic, "Bitwise-reproducible run: default seed, no dropped frames, state hashes in reports"},
+		{"num_particles", &config::num_particles, "Number of generated particles"},
+		{"initial_velocity_factor", &config::initial_velocity_factor, "Initial angular velocity of the generated sphere"},
+		{"generation_scale", &config::generation_scale, "Radius of the generated scene relative to the simulation volume"},
+		{"plummer_scale", &config::plummer_scale, "Plummer scale radius relative to the generated radius"},
+		{"disk_thickness", &config::disk_thickness, "Disk thickness (standard deviation) relative to the generated radius"},
+		{"particle_scale", &config::particle_scale, "Rendered particle size scale"},
+		{"fov", &config::fov, "Vertical field of view in degrees"},
+		{"lod_threshold", &config::lod_threshold, "Projected cell size in pixels below which a cell is drawn as one point, 0 disables"},
+		{"extrapolate", &config::extrapolate, "Advance the drawn particles along their velocities between simulation steps"},
+		{"num_steps", &config::num_steps, "Steps to run in the headless executable"},
+		{"report_interval", &config::report_interval, "Steps between headless progress reports"},
+		{"stats_log_interval", &config::stats_log_interval, "Seconds between the viewer's step statistics lines, 0 disables them"},
+		{"trace", &config::trace, "Chrome trace JSON of the head, worker and output threads written at exit"},
+		{"perf_counters", &config::perf_counters, "Sample hardware performance counters around every phase (Linux perf_event_open)"},
+		{"restart", &config::restart, "Checkpoint file to restart from"},
+		{"checkpoint", &config::checkpoint, "Checkpoint file written by the headless executable"},
+		{"checkpoint_interval", &config::checkpoint_interval, "Steps between checkpoints, 0 writes one at the end only"},
+		{"trajectory", &config::trajectory, "Trajectory file written by the headless executable"},
+		{"trajectory_interval", &config::trajectory_interval, "Steps between trajectory frames, 0 disables the trajectory"},
+		{"trajectory_precision", &config::trajectory_precision, "Maximum quantization cell size of trajectory positions"},
+		{"trajectory_async", &config::trajectory_async, "Write trajectory frames on a separate thread"},
+		{"trajectory_buffers", &config::trajectory_buffers, "Snapshot buffers queued for the trajectory thread"},
+		{"trajectory_drop_frames", &config::trajectory_drop_frames, "Drop frames instead of blocking when the trajectory thread falls behind"},
+		{"trajectory_direct_io", &config::trajectory_direct_io, "Bypass the page cache when writing the trajectory, if supported"},
+		{"image", &config::image, "Path prefix of the frames rendered by the headless executable"},
+		{"image_interval", &config::image_interval, "Steps between rendered frames, 0 disables them"},
+		{"image_width", &config::image_width, "Width of the rendered frames"},
+		{"image_height", &config::image_height, "Height of the rendered frames"},
+		{"image_format", &config::image_format, "Format of the rendered frames: png or ppm"},
+		{"image_zoom", &config::image_zoom, "Camera distance factor of the rendered frames"},
+		{"image_threads", &config::image_threads, "Threads rendering the frames, 0 uses all hardware threads"},
+		{"image_drop_frames", &config::image_drop_frames, "Skip frames instead of blocking when rendering falls behind"},
+	};
+
+	const option *find_option(const std::string &key)
+	{
+		for (const option &o : options)
+		{
+			if (key == o.key)
+			{
+				return &o;
+			}
+		}
+		return nullptr;
+	}
+
+	bool is_flag(const option &o)
+	{
+		return std::holds_alternative<bool config::*>(o.member) || std::holds_alternative<bool simulation::timestep_control::*>(o.member);
+	}
+
+	template <typename T>
+	T parse_value(const std::string &key, const std::string &value);
+
+	template <>
+	double parse_value<double>(const std::string &key, const std::string &value)
+	{
+		size_t end = 0;
+		double result = 0;
+		try
+		{
+			result = std::stod(value, &end);
+		}
+		catch (const std::exception &)
+		{
+		}
+		if (end == 0 || end != value.size())
+		{
+			THROW_PRINTF("Invalid value '%s' for '%s', expected a number", value.c_str(), key.c_str());
+		}
+		return result;
+	}
+
+	template <>
+	float parse_value<float>(const std::string &key, const std::string &value)
+	{
+		return static_cast<float>(parse_value<double>(key, value));
+	}
+
+	template <>
+	size_t parse_value<size_t>(const std::string &key, const std::string &value)
+	{
+		size_t end = 0;
+		unsigned long long result = 0;
+		try
+		{
+			result = std::stoull(value, &end);
+		}
+		catch (const std::exception &)
+		{
+		}
+		if (end == 0 || end != value.size() || value[0] == '-')
+		{
+			THROW_PRINTF("Invalid value '%s' for '%s', expected a non-negative integer", value.c_str(), key.c_str());
+		}
+		return static_cast<size_t>(result);
+	}
+
+	template <>
+	std::string parse_value<std::string>(const std::string &, const std::string &value)
+	{
+		return value;
+	}
+
+	template <>
+	bool parse_value<bool>(const std::string &key, const std::string &value)
+	{
+		if (value == "1" || value == "true" || value == "on" || value == "yes")
+		{
+			return true;
+		}
+		if (value == "0" || value == "false" || value == "off" || value == "no")
+		{
+			return false;
+		}
+		THROW_PRINTF("Invalid value '%s' for '%s', expected true or false", value.c_str(), key.c_str());
+	}
+
+	std::string trim(const std::string &str)
+	{
+		const size_t begin = str.find_first_not_of(" \t\r");
+		if (begin == std::string::npos)
+		{
+			return {};
+		}
+		const size_t end = str.find_last_not_of(" \t\r");
+		return str.substr(begin, end - begin + 1);
+	}
+}
+
+void config::set(const std::string &key, const std::string &value)
+{
+	const option *const o = find_option(key);
+	if (o == nullptr)
+	{
+		THROW_PRINTF("Unknown parameter '%s'", key.c_str());
+	}
+
+	std::visit([&](auto member) {
+		using member_type = decltype(member);
+		if constexpr (std::is_same_v<member_type, double config::*> || std::is_same_v<member_type, float config::*> ||
+		              std::is_same_v<member_type, size_t config::*> || std::is_same_v<member_type, bool config::*> ||
+		              std::is_same_v<member_type, std::string config::*>)
+		{
+			auto &field = this->*member;
+			field = parse_value<std::remove_reference_t<decltype(field)>>(key, value);
+		}
+		else if constexpr (std::is_same_v<member_type, double simulation::parameters::*> || std::is_same_v<member_type, size_t simulation::parameters::*>)
+		{
+			auto &field = sim.*member;
+			field = parse_value<std::remove_reference_t<decltype(field)>>(key, value);
+		}
+		else
+		{
+			auto &field = sim.timestep.*member;
+			field = parse_value<std::remove_reference_t<decltype(field)>>(key, value);
+		}
+	}, o->member);
+}
+
+void config::load_file(const std::string &path)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+		THROW_PRINTF("Failed to open config file '%s'", path.c_str());
+	}
+
+	std::string line;
+	size_t line_number = 0;
+	while (std::getline(file, line))
+	{
+		++line_number;
+		line = trim(line.substr(0, line.find('#')));
+		if (line.empty())
+		{
+			continue;
+		}
+
+		const size_t separator = line.find('=');
+		if (separator == std::string::npos)
+		{
+			THROW_PRINTF("%s:%zu: expected 'key = value'", path.c_str(), line_number);
+		}
+
+		set(trim(line.substr(0, separator)), trim(line.substr(separator + 1)));
+	}
+}
+
+void config::load(const int &argc, const char *const *argv)
+{
+	/* The config file is applied first so the command line can override it. */
+	std::vector<std::pair<std::string, std::string>> overrides;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const char *const arg = argv[i];
+		if (std::strncmp(arg, "--", 2) != 0)
+		{
+			THROW_PRINTF("Unexpected argument '%s'", arg);
+		}
+
+		std::string key = arg + 2;
+		std::string value;
+		const size_t separator = key.find('=');
+		if (separator != std::string::npos)
+		{
+			value = key.substr(separator + 1);
+			key = key.substr(0, separator);
+		}
+		else if (key == "help")
+		{
+			help = true;
+			return;
+		}
+		else
+		{
+			const option *const o = find_option(key);
+			const bool has_value = i + 1 < argc && std::strncmp(argv[i + 1], "--", 2) != 0;
+			if (o != nullptr && is_flag(*o) && !has_value)
+			{
+				value = "true";
+			}
+			else if (has_value)
+			{
+				value = argv[++i];
+			}
+			else
+			{
+				THROW_PRINTF("Missing value for '%s'", key.c_str());
+			}
+		}
+
+		if (key == "config")
+		{
+			load_file(value);
+		}
+		else
+		{
+			overrides.emplace_back(std::move(key), std::move(value));
+		}
+	}
+
+	for (const auto &[key, value] : overrides)
+	{
+		set(key, value);
+	}
+
+	simulation::validate_parameters(sim);
+}
+
+void config::extract_options(std::vector<const char *> &args, const std::vector<std::pair<std::string, std::string *>> &options)
+{
+	std::vector<const char *> rest;
+	for (size_t i = 0; i < args.size(); ++i)
+	{
+		const std::string arg = args[i];
+		bool taken = false;
+		for (const auto &[key, value] : options)
+		{
+			const std::string prefix = "--" + key;
+			if (arg == prefix)
+			{
+				ASSERT_EX_M_PRINTF(i + 1 < args.size(), "Missing value for '%s'", key.c_str());
+				*value = args[++i];
+				taken = true;
+			}
+			else if (arg.compare(0, prefix.size() + 1, prefix + "=") == 0)
+			{
+				*value = arg.substr(prefix.size() + 1);
+				taken = true;
+			}
+		}
+		if (!taken)
+		{
+			rest.push_back(args[i]);
+		}
+	}
+	args.swap(rest);
+}
+
+template <typename T>
+std::vector<T> config::parse_list(const std::string &key, const std::string &list)
+{
+	std::vector<T> values;
+	size_t begin = 0;
+	while (begin <= list.size())
+	{
+		const size_t end = std::min(list.find(',', begin), list.size());
+		values.push_back(parse_value<T>(key, trim(list.substr(begin, end - begin))));
+		begin = end + 1;
+	}
+	return values;
+}
+
+template std::vector<double> config::parse_list<double>(const std::string &key, const std::string &list);
+template std::vector<size_t> config::parse_list<size_t>(const std::string &key, const std::string &list);
+
+void config::print_usage(const char *program)
+{
+	std::printf("Usage: %s [--config <file>] [--<key>=<value>]...\n\n", program);
+	for (const option &o : options)
+	{
+		std::printf("  --%-24s %s\n", o.key, o.description);
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "simulation.hpp"
+
+/* Runtime parameters shared by the viewer and the headless executable.
+ *
+ * Every field can be set from a config file of "key = value" lines ('#' starts a comment)
+ * given with --config <path>, and overridden on the command line with --key=value or
+ * --key value. Boolean flags may omit the value. --help lists all keys. */
+struct config
+{
+	simulation::parameters sim;
+	/* Initial conditions: sphere, plummer or disk, reproducible from seed (0 picks a random one). */
+	std::string scene = "sphere";
+	size_t seed = 0;
+	size_t num_particles = 32000;
+	double initial_velocity_factor = 0.04;
+	double generation_scale = 1.;
+	/* Plummer scale radius and disk thickness, relative to the generated radius. */
+	double plummer_scale = 0.2;
+	double disk_thickness = 0.02;
+	float particle_scale = 1.;
+	float fov = 70;
+	/* Projected cell size in pixels below which the viewer draws a cell as one point, 0 disables. */
+	float lod_threshold = 1;
+	/* Advance the drawn particles along their velocities between simulation steps. */
+	bool extrapolate = true;
+	size_t num_steps = 1000;
+	size_t report_interval = 100;
+	/* Seconds between the viewer's step statistics lines, 0 disables them. */
+	double stats_log_interval = 1;
+	/* Chrome trace JSON of every phase on every thread, written at exit (empty disables tracing). */
+	std::string trace;
+	/* Hardware counters per phase in the step statistics, Linux only. */
+	bool perf_counters = false;
+	/* Checkpoint to restart from instead of generating particles. */
+	std::string restart;
+	/* Checkpoint written every checkpoint_interval steps (0 only at the end) by the headless executable. */
+	std::string checkpoint;
+	size_t checkpoint_interval = 0;
+	/* Compressed position snapshots written every trajectory_interval steps (0 disables). */
+	std::string trajectory;
+	size_t trajectory_interval = 0;
+	double trajectory_precision = 0.01;
+	/* Encode and write frames on a separate thread fed by trajectory_buffers snapshot buffers. */
+	bool trajectory_async = true;
+	size_t trajectory_buffers = 4;
+	/* Drop frames instead of stalling the simulation when the writer falls behind. */
+	bool trajectory_drop_frames = false;
+	bool trajectory_direct_io = false;
+	/* Software-rendered frames written by the headless executable every image_interval steps
+	 * (0 disables) to <image>_<step>.<image_format>, with the viewer's camera and blending. */
+	std::string image;
+	size_t image_interval = 0;
+	size_t image_width = 1280;
+	size_t image_height = 720;
+	std::string image_format = "png";
+	float image_zoom = 1;
+	size_t image_threads = 2;
+	/* Skip frames instead of stalling the simulation when rendering falls behind. */
+	bool image_drop_frames = true;
+	/* Bitwise-reproducible runs: seed 0 falls back to default_seed, trajectory frames are never
+	 * dropped and the headless executable logs the state hash with every report. */
+	bool deterministic = false;
+	static constexpr size_t default_seed = 1;
+	bool help = false;
+
+	/* Throws on unknown keys, malformed or out of range values, or unreadable config files. */
+	void load(const int &argc, const char *const *argv);
+
+	void load_file(const std::string &path);
+
+	void set(const std::string &key, const std::string &value);
+
+	static void print_usage(const char *program);
+
+	/* Removes the --key=value or --key value arguments of the given keys from args (argv with the
+	 * program name) and stores their values, so that tools can add options to the config keys. */
+	static void extract_options(std::vector<const char *> &args, const std::vector<std::pair<std::string, std::string *>> &options);
+
+	/* Parses a comma separated list of numbers for a tool option, defined for double and size_t. */
+	template <typename T>
+	static std::vector<T> parse_list(const std::string &key, const std::string &list);
+};
@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "helper.hpp"
+#include "config.hpp"
+#include "initial_conditions.hpp"
+#include "integrator.hpp"
+#include "output_file.hpp"
+#include "simulation.hpp"
+
+/* Order of convergence of the compiled integrator.
+ *
+ * Runs one seeded scene to --time with dt, dt/2, ... dt/2^refinements and compares the positions
+ * with a reference run --reference halvings finer still. Halving dt divides the error by 2^order,
+ * so the observed order is log2 of the ratio of successive errors. The default scene is a few
+ * widely spaced particles (no contact forces, which aren't smooth) with one particle per leaf: the
+ * far field then is exact, and particles moving between leafs don't make the force jump, while
+ * most pairs still go through the far field. Exits with an error when the observed order of the
+ * finest pair falls more than half an order short of integrator::order, or of 2 with r-RESPA
+ * (far_field_interval > 1). Besides the options below, every key of the simulation config is
+ * accepted. */
+namespace
+{
+	std::vector<vec3<double>> run(const config &cfg, const std::vector<particle> &particles, const double &dt, const size_t &num_steps)
+	{
+		simulation::parameters params = cfg.sim;
+		params.dt = dt;
+		params.timestep.enabled = false;
+		simulation sim(params);
+		sim.add_bulk(particles);
+		sim.step(num_steps);
+
+		std::vector<vec3<double>> positions;
+		positions.reserve(particles.size());
+		sim.for_each_particle_block([&](const particle *block, const size_t &num)
+		{
+			for (size_t i = 0; i < num; ++i)
+			{
+				positions.push_back(block[i].pos);
+			}
+		});
+		return positions;
+	}
+
+	/* RMS distance to the nearest reference position. Particles leave their leafs during a run, so
+	 * they are matched by position, which holds while the error is below the particle spacing. */
+	double rms_error(const std::vector<vec3<double>> &positions, const std::vector<vec3<double>> &reference)
+	{
+		double sum = 0;
+		for (const vec3<double> &p : positions)
+		{
+			double nearest = std::numeric_limits<double>::max();
+			for (const vec3<double> &r : reference)
+			{
+				const vec3<double> d = p - r;
+				nearest = std::min(nearest, d * d);
+			}
+			sum += nearest;
+		}
+		return std::sqrt(sum / std::max<size_t>(positions.size(), 1));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		std::string out = "particles_convergence.csv";
+		std::string time = "20";
+		std::string refinements = "3";
+		std::string reference = "3";
+
+		std::vector<const char *> args(argv, argv + argc);
+		config::extract_options(args, {{"out", &out}, {"time", &time}, {"refinements", &refinements}, {"reference", &reference}});
+
+		config cfg;
+		cfg.num_particles = 64;
+		cfg.seed = config::default_seed;
+		cfg.generation_scale = 0.5;
+		cfg.sim.dt = 1;
+		cfg.sim.particle_size = 0.01;
+		cfg.sim.cell_particles_limit = 1;
+		cfg.load(static_cast<int>(args.size()), args.data());
+		if (cfg.help)
+		{
+			std::printf("Usage: %s [--out=<csv>] [--time=<t>] [--refinements=<n>] [--reference=<n>] [config options]\n\n", argv[0]);
+			config::print_usage(argv[0]);
+			return 0;
+		}
+
+		const double end_time = std::stod(time);
+		const size_t num_refinements = std::max<size_t>(std::stoull(refinements), 1);
+		const size_t reference_halvings = std::max<size_t>(std::stoull(reference), 1);
+		const size_t base_steps = std::max<size_t>(static_cast<size_t>(std::llround(end_time / cfg.sim.dt)), 1);
+
+		const std::vector<particle> particles = generate_scene(cfg);
+		INFO("%s integrator, %zu particles, far_field_interval %zu, %zu steps of dt %g", integrator::name, particles.size(),
+		     cfg.sim.far_field_interval, base_steps, cfg.sim.dt);
+
+		const size_t reference_factor = size_t(1) << (num_refinements + reference_halvings);
+		const std::vector<vec3<double>> reference_positions = run(cfg, particles, cfg.sim.dt / reference_factor, base_steps * reference_factor);
+
+		std::string csv = "integrator,far_field_interval,dt,steps,rms_error,observed_order\n";
+		double prev_error = 0;
+		double order = 0;
+		for (size_t k = 0; k <= num_refinements; ++k)
+		{
+			const size_t factor = size_t(1) << k;
+			const double dt = cfg.sim.dt / factor;
+			const double error = rms_error(run(cfg, particles, dt, base_steps * factor), reference_positions);
+			order = prev_error > 0 && error > 0 ? std::log2(prev_error / error) : 0;
+			prev_error = error;
+
+			INFO("dt %g: rms position error %.3e, observed order %.2f", dt, error, order);
+
+			char line[256];
+			std::snprintf(line, sizeof(line), "%s,%zu,%.9g,%zu,%.6e,%.4f\n", integrator::name, cfg.sim.far_field_interval, dt,
+			              base_steps * factor, error, order);
+			csv += line;
+		}
+
+		output_file file(out, false);
+		file.write(csv.data(), csv.size());
+		file.close();
+		INFO("Results written to '%s'", out.c_str());
+
+		/* The far field impulses of r-RESPA are a second order splitting on their own. */
+		const int expected_order = cfg.sim.far_field_interval > 1 ? std::min(integrator::order, 2) : integrator::order;
+		ASSERT_EX_M_PRINTF(order >= expected_order - 0.5, "Observed order %.2f of the %s integrator, expected %d", order,
+		                   integrator::name, expected_order);
+	}
+	catch(const std::exception &ex)
+	{
+		ERROR("%s", ex.what());
+		return -1;
+	}
+
+	return 0;
+}
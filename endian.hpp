@@ -0,0 +1,28 @@
+#pragma once
+#include <bit>
+#include <cstring>
+#include <utility>
+
+/* File formats are little-endian; these are no-ops on little-endian hosts. */
+template <typename T>
+T to_little_endian(T value)
+{
+	if constexpr (std::endian::native == std::endian::big)
+	{
+		unsigned char bytes[sizeof(T)];
+		std::memcpy(bytes, &value, sizeof(T));
+		for (size_t i = 0; i < sizeof(T) / 2; ++i)
+		{
+			std::swap(bytes[i], bytes[sizeof(T) - 1 - i]);
+		}
+		std::memcpy(&value, bytes, sizeof(T));
+	}
+	return value;
+}
+
+/* Swapping is an involution, so the same function converts both ways. */
+template <typename T>
+T from_little_endian(T value)
+{
+	return to_little_endian(value);
+}
@@ -0,0 +1,249 @@
+#include <chrono>
+#include <cstdio>
+#include <numeric>
+
+#include "headless_application.hpp"
+#include "initial_conditions.hpp"
+#include "checkpoint.hpp"
+#include "helper.hpp"
+#include "tracer.hpp"
+
+void headless_application::init()
+{
+	tracer::enable(!m_config.trace.empty());
+
+	/* There is no render thread, so the default num_threads = 0 gives every hardware thread to the simulation. */
+	if (!m_config.restart.empty())
+	{
+		m_simulation = load_checkpoint(m_config.restart, m_config.sim.num_threads);
+		INFO("Restarted from '%s' at time %f with %zu particles", m_config.restart.c_str(), m_simulation->get_sim_time(), m_simulation->get_num_particles());
+	}
+	else
+	{
+		m_simulation = std::make_unique<simulation>(m_config.sim);
+
+		generate_particles();
+	}
+
+	m_simulation->set_perf_counters_enabled(m_config.perf_counters);
+
+	open_trajectory();
+	open_images();
+
+	/* One callback serves both writers, at every step either of them needs. */
+	const size_t trajectory_interval = m_trajectory ? m_config.trajectory_interval : 0;
+	const size_t image_interval = m_image_writer ? m_config.image_interval : 0;
+	m_simulation->set_snapshot_callback(std::gcd(trajectory_interval, image_interval), [this](std::vector<vec3<double>> &positions, const uint64_t &step, const double &sim_time)
+	{
+		return take_snapshot(positions, step, sim_time);
+	});
+}
+
+void headless_application::open_trajectory()
+{
+	if (m_config.trajectory.empty() || m_config.trajectory_interval == 0)
+	{
+		return;
+	}
+
+	m_trajectory = std::make_unique<trajectory_writer>(m_config.trajectory, m_simulation->get_size() / 2, m_config.trajectory_precision, m_config.trajectory_direct_io);
+
+	if (!m_config.trajectory_async)
+	{
+		return;
+	}
+
+	if (m_config.trajectory_drop_frames && m_config.deterministic)
+	{
+		WARNING("trajectory_drop_frames is ignored in deterministic mode");
+	}
+	const bool drop = m_config.trajectory_drop_frames && !m_config.deterministic;
+	const auto policy = drop ? snapshot_writer::overflow_policy::drop : snapshot_writer::overflow_policy::block;
+	m_snapshot_writer = std::make_unique<snapshot_writer>(m_config.trajectory_buffers, m_simulation->get_num_particles(), policy,
+		[this](const std::vector<vec3<double>> &positions, const uint64_t &step, const double &sim_time)
+		{
+			tracer::set_thread_name("trajectory writer");
+			tracer::scope scope("write_frame");
+			scope.set_arg("step", step);
+			m_trajectory->write_frame(positions.data(), positions.size(), step, sim_time);
+		});
+}
+
+void headless_application::open_images()
+{
+	if (m_config.image.empty() || m_config.image_interval == 0)
+	{
+		return;
+	}
+
+	ASSERT_EX_M_PRINTF(m_config.image_format == "png" || m_config.image_format == "ppm",
+	                   "Unknown image_format '%s', expected png or ppm", m_config.image_format.c_str());
+	ASSERT_EX_M(m_config.image_width > 0 && m_config.image_height > 0, "image_width and image_height must be positive");
+
+	m_splat_renderer = std::make_unique<splat_renderer>(m_config.image_width, m_config.image_height, m_simulation->get_size(),
+	                                                    m_simulation->get_particle_size(), m_config.particle_scale,
+	                                                    degrees_to_radians(m_config.fov), m_config.image_zoom, m_config.image_threads);
+
+	const bool drop = m_config.image_drop_frames && !m_config.deterministic;
+	const auto policy = drop ? snapshot_writer::overflow_policy::drop : snapshot_writer::overflow_policy::block;
+	/* Two buffers: one being rendered, one waiting. */
+	m_image_writer = std::make_unique<snapshot_writer>(2, m_simulation->get_num_particles(), policy,
+		[this](const std::vector<vec3<double>> &positions, const uint64_t &step, const double &)
+		{
+			tracer::set_thread_name("renderer");
+			tracer::scope scope("render_frame");
+			scope.set_arg("step", step);
+			const rgb_image &image = m_splat_renderer->render(positions);
+
+			char path[4096];
+			std::snprintf(path, sizeof(path), "%s_%08llu.%s", m_config.image.c_str(), static_cast<unsigned long long>(step), m_config.image_format.c_str());
+			if (m_config.image_format == "png")
+			{
+				write_png(image, path);
+			}
+			else
+			{
+				write_ppm(image, path);
+			}
+		});
+}
+
+void headless_application::close_images()
+{
+	if (m_image_writer)
+	{
+		m_image_writer->flush();
+		INFO("%zu frames rendered, %zu skipped", m_image_writer->get_written(), m_image_writer->get_dropped());
+		if (m_image_writer->get_failed() > 0)
+		{
+			WARNING("%zu frames failed to render", m_image_writer->get_failed());
+		}
+	}
+}
+
+bool headless_application::take_snapshot(std::vector<vec3<double>> &positions, const uint64_t &step, const double &sim_time)
+{
+	const bool trajectory_frame = m_trajectory && step % m_config.trajectory_interval == 0;
+	const bool image_frame = m_image_writer && step % m_config.image_interval == 0;
+
+	if (image_frame && trajectory_frame)
+	{
+		m_image_positions = positions;
+		m_image_writer->submit(m_image_positions, step, sim_time);
+	}
+	else if (image_frame)
+	{
+		return m_image_writer->submit(positions, step, sim_time);
+	}
+
+	if (trajectory_frame && m_snapshot_writer)
+	{
+		return m_snapshot_writer->submit(positions, step, sim_time);
+	}
+	if (trajectory_frame)
+	{
+		m_trajectory->write_frame(positions.data(), positions.size(), step, sim_time);
+	}
+	return false;
+}
+
+void headless_application::close_trajectory()
+{
+	if (m_snapshot_writer)
+	{
+		m_snapshot_writer->flush();
+		if (m_snapshot_writer->get_dropped() > 0)
+		{
+			WARNING("%zu trajectory frames were dropped", m_snapshot_writer->get_dropped());
+		}
+		if (m_snapshot_writer->get_failed() > 0)
+		{
+			WARNING("%zu trajectory frames failed to write", m_snapshot_writer->get_failed());
+		}
+	}
+
+	if (m_trajectory)
+	{
+		m_trajectory->close();
+	}
+}
+
+void headless_application::generate_particles()
+{
+	m_simulation->add_bulk(generate_scene(m_config));
+}
+
+void headless_application::run()
+{
+	simulation::step_timings total;
+	size_t steps_done = 0;
+	while (steps_done < m_config.num_steps)
+	{
+		size_t num = std::min(std::max<size_t>(m_config.report_interval, 1), m_config.num_steps - steps_done);
+		if (m_config.checkpoint_interval > 0)
+		{
+			num = std::min(num, m_config.checkpoint_interval - steps_done % m_config.checkpoint_interval);
+		}
+
+		const simulation::step_timings t = m_simulation->step(num);
+		steps_done += t.steps;
+
+		if (m_config.checkpoint_interval > 0 && steps_done % m_config.checkpoint_interval == 0)
+		{
+			write_checkpoint();
+		}
+
+		const simulation::step_stats average = simulation::average_step_stats(m_simulation->get_step_stats(t.steps));
+		INFO("step %zu, steps/s: %f, sim time/s: %f, %s", steps_done, t.steps / t.total, t.sim_time / t.total,
+		     simulation::format_step_stats(average).c_str());
+
+		if (m_config.deterministic)
+		{
+			INFO("step %zu, state hash: %016llx", steps_done, static_cast<unsigned long long>(m_simulation->state_hash()));
+		}
+
+		total.steps += t.steps;
+		total.sim_time += t.sim_time;
+		total.total += t.total;
+	}
+
+	if (total.steps > 0)
+	{
+		INFO("%zu steps in %f s, %f steps/s, simulated time: %f", total.steps, total.total, total.steps / total.total, total.sim_time);
+	}
+
+	if (m_config.checkpoint_interval == 0 || steps_done % m_config.checkpoint_interval != 0)
+	{
+		write_checkpoint();
+	}
+
+	close_trajectory();
+	close_images();
+
+	if (!m_config.trace.empty())
+	{
+		tracer::write(m_config.trace);
+	}
+}
+
+void headless_application::write_checkpoint()
+{
+	if (m_config.checkpoint.empty())
+	{
+		return;
+	}
+
+	const auto t1 = std::chrono::steady_clock::now();
+	save_checkpoint(*m_simulation, m_config.checkpoint);
+	const auto t2 = std::chrono::steady_clock::now();
+	INFO("Checkpoint written to '%s' in %f s", m_config.checkpoint.c_str(), std::chrono::duration<double>(t2 - t1).count());
+}
+
+headless_application::headless_application(const config &cfg) : m_config(cfg)
+{
+	init();
+}
+
+headless_application::~headless_application()
+{
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <memory>
+
+#include "simulation.hpp"
+#include "config.hpp"
+#include "trajectory.hpp"
+#include "snapshot_writer.hpp"
+#include "splat_renderer.hpp"
+
+class headless_application
+{
+private:
+	const config m_config;
+
+	std::unique_ptr<simulation> m_simulation;
+	std::unique_ptr<trajectory_writer> m_trajectory;
+	/* Declared after m_trajectory so it is destroyed, and drained, first. */
+	std::unique_ptr<snapshot_writer> m_snapshot_writer;
+	std::unique_ptr<splat_renderer> m_splat_renderer;
+	std::unique_ptr<snapshot_writer> m_image_writer;
+	/* Copy of the positions for the image writer when the trajectory takes them too. */
+	std::vector<vec3<double>> m_image_positions;
+
+	void init();
+	void generate_particles();
+	void write_checkpoint();
+	void open_trajectory();
+	void close_trajectory();
+	void open_images();
+	void close_images();
+	/* Hands the positions of a step to the trajectory and image writers, as the snapshot callback. */
+	bool take_snapshot(std::vector<vec3<double>> &positions, const uint64_t &step, const double &sim_time);
+
+public:
+	headless_application(const config &cfg);
+	~headless_application();
+
+	void run();
+};
@@ -0,0 +1,26 @@
+#include "helper.hpp"
+#include "headless_application.hpp"
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		config cfg;
+		cfg.load(argc, argv);
+		if (cfg.help)
+		{
+			config::print_usage(argv[0]);
+			return 0;
+		}
+
+		headless_application application(cfg);
+		application.run();
+	}
+	catch(const std::exception &ex)
+	{
+		ERROR("%s", ex.what());
+		return -1;
+	}
+
+	return 0;
+}
@@ -20,13 +20,13 @@
 	}
 
 #define ASSERT_EX_M(expr, msg) \
-	if (!expr)                 \
+	if (!(expr))               \
 	{                          \
 		THROW(msg);            \
 	}
 
 #define ASSERT_EX_M_PRINTF(expr, msg, ...) \
-	if (!expr)                             \
+	if (!(expr))                           \
 	{                                      \
 		THROW_PRINTF(msg, ##__VA_ARGS__);  \
 	}
@@ -40,7 +40,7 @@
 #define DEBUG_ASSERT(expr) assert(expr)
 
 #define CRITICAL_ASSERT_M(expr, msg, ...) \
-	if (!expr)                            \
+	if (!(expr))                          \
 	{                                     \
 		ERROR(msg, ##__VA_ARGS__);        \
 		exit(-1);                         \
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <array>
+#include <cstdio>
+
+#include "image.hpp"
+#include "helper.hpp"
+
+namespace
+{
+	class file
+	{
+		std::FILE *m_file;
+		const std::string &m_path;
+
+	public:
+		file(const std::string &path) : m_file(std::fopen(path.c_str(), "wb")), m_path(path)
+		{
+			ASSERT_EX_M_PRINTF(m_file, "Failed to open image '%s'", path.c_str());
+		}
+
+		~file()
+		{
+			std::fclose(m_file);
+		}
+
+		void write(const void *data, const size_t &size)
+		{
+			ASSERT_EX_M_PRINTF(std::fwrite(data, 1, size, m_file) == size, "Failed to write image '%s'", m_path.c_str());
+		}
+	};
+
+	uint32_t crc32(uint32_t crc, const uint8_t *data, const size_t &size)
+	{
+		static const std::array<uint32_t, 256> table = []
+		{
+			std::array<uint32_t, 256> t;
+			for (uint32_t i = 0; i < 256; ++i)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; ++k)
+				{
+					c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+				}
+				t[i] = c;
+			}
+			return t;
+		}();
+
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+		{
+			crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		}
+		return ~crc;
+	}
+
+	void append_u32_be(std::vector<uint8_t> &out, const uint32_t &v)
+	{
+		out.push_back(v >> 24);
+		out.push_back(v >> 16);
+		out.push_back(v >> 8);
+		out.push_back(v);
+	}
+
+	/* Length, type, data, CRC of type and data. */
+	void write_chunk(file &f, const char *type, const std::vector<uint8_t> &data)
+	{
+		std::vector<uint8_t> chunk;
+		chunk.reserve(data.size() + 12);
+		append_u32_be(chunk, data.size());
+		chunk.insert(chunk.end(), type, type + 4);
+		chunk.insert(chunk.end(), data.begin(), data.end());
+		append_u32_be(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+		f.write(chunk.data(), chunk.size());
+	}
+}
+
+void write_ppm(const rgb_image &image, const std::string &path)
+{
+	file f(path);
+	char header[64];
+	const int length = std::snprintf(header, sizeof(header), "P6\n%zu %zu\n255\n", image.width, image.height);
+	f.write(header, length);
+	f.write(image.pixels.data(), image.pixels.size());
+}
+
+void write_png(const rgb_image &image, const std::string &path)
+{
+	file f(path);
+	const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	f.write(signature, sizeof(signature));
+
+	std::vector<uint8_t> ihdr;
+	append_u32_be(ihdr, image.width);
+	append_u32_be(ihdr, image.height);
+	/* 8 bits per channel, RGB, deflate, adaptive filtering, no interlace. */
+	ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0});
+	write_chunk(f, "IHDR", ihdr);
+
+	/* Every row is prefixed with filter type 0 (none). */
+	const size_t row_size = image.width * 3;
+	std::vector<uint8_t> raw;
+	raw.reserve((row_size + 1) * image.height);
+	for (size_t y = 0; y < image.height; ++y)
+	{
+		raw.push_back(0);
+		raw.insert(raw.end(), image.pixels.begin() + y * row_size, image.pixels.begin() + (y + 1) * row_size);
+	}
+
+	/* zlib stream of stored blocks of at most 65535 bytes, followed by the Adler-32 of the data. */
+	constexpr size_t max_block = 65535;
+	std::vector<uint8_t> idat;
+	idat.reserve(raw.size() + raw.size() / max_block * 5 + 16);
+	idat.push_back(0x78);
+	idat.push_back(0x01);
+	for (size_t offset = 0; offset < raw.size() || offset == 0; offset += max_block)
+	{
+		const size_t size = std::min(max_block, raw.size() - offset);
+		idat.push_back(offset + size == raw.size() ? 1 : 0);
+		idat.push_back(size);
+		idat.push_back(size >> 8);
+		idat.push_back(~size);
+		idat.push_back(~size >> 8);
+		idat.insert(idat.end(), raw.begin() + offset, raw.begin() + offset + size);
+	}
+
+	uint32_t a = 1, b = 0;
+	for (const uint8_t &v : raw)
+	{
+		a = (a + v) % 65521;
+		b = (b + a) % 65521;
+	}
+	append_u32_be(idat, b << 16 | a);
+	write_chunk(f, "IDAT", idat);
+
+	write_chunk(f, "IEND", {});
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* 8-bit RGB pixels, rows from top to bottom. */
+struct rgb_image
+{
+	size_t width = 0;
+	size_t height = 0;
+	std::vector<uint8_t> pixels;
+};
+
+/* Binary PPM (P6). */
+void write_ppm(const rgb_image &image, const std::string &path);
+
+/* PNG with uncompressed (stored) deflate blocks, so no compression library is needed. */
+void write_png(const rgb_image &image, const std::string &path);
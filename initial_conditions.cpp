@@ -0,0 +1,126 @@
+#include <random>
+#include <thread>
+
+#include "initial_conditions.hpp"
+#include "config.hpp"
+#include "random.hpp"
+#include "parallel.hpp"
+#include "helper.hpp"
+
+template <typename F>
+static std::vector<particle> generate(const size_t &num_particles, const uint64_t &seed, size_t num_threads, F &&f)
+{
+	if (num_threads == 0)
+	{
+		num_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+
+	std::vector<particle> particles(num_particles);
+	parallel_for(num_threads, num_particles, [&](const size_t &begin, const size_t &end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			philox_rng rng(seed, i);
+			particles[i] = f(rng);
+		}
+	});
+	return particles;
+}
+
+/* Uniformly distributed direction. */
+static vec3<double> random_direction(philox_rng &rng)
+{
+	const vec3<double> v = {rng.normal(0, 1), rng.normal(0, 1), rng.normal(0, 1)};
+	return v / sqrt(v * v);
+}
+
+std::vector<particle> uniform_sphere(const size_t &num_particles, const double &radius, const double &initial_velocity_factor,
+                                     const uint64_t &seed, const size_t &num_threads)
+{
+	return generate(num_particles, seed, num_threads, [&](philox_rng &rng)
+	{
+		/* Uniform points distribution inside the volume of a sphere:
+		 * https://math.stackexchange.com/questions/87230/picking-random-points-in-the-volume-of-sphere-with-uniform-probability
+		 */
+		particle p = {};
+		p.pos = random_direction(rng) * pow(rng.uniform(), 1.0 / 3) * radius;
+		p.v = vec3<double>{p.pos.y, -p.pos.x, 0} * initial_velocity_factor;
+		return p;
+	});
+}
+
+std::vector<particle> plummer_sphere(const size_t &num_particles, const double &scale_radius, const double &max_radius, const double &gm,
+                                     const uint64_t &seed, const size_t &num_threads)
+{
+	/* Aarseth, Henon & Wielen (1974). The radius comes from inverting the cumulative mass
+	 * M(r) = r^3 / (r^2 + a^2)^(3/2), restricted to r <= max_radius. */
+	const double max_mass_fraction = pow(max_radius * max_radius / (max_radius * max_radius + scale_radius * scale_radius), 1.5);
+
+	return generate(num_particles, seed, num_threads, [&](philox_rng &rng)
+	{
+		const double m = max_mass_fraction * (1. - rng.uniform());
+		const double r = scale_radius / sqrt(pow(m, -2.0 / 3) - 1.);
+
+		/* q = v / v_escape from g(q) = q^2 (1 - q^2)^3.5 by rejection, g <= 0.1. */
+		double q;
+		do
+		{
+			q = rng.uniform();
+		} while (0.1 * rng.uniform() > q * q * pow(1. - q * q, 3.5));
+		const double v_escape = sqrt(2. * gm / sqrt(r * r + scale_radius * scale_radius));
+
+		particle p = {};
+		p.pos = random_direction(rng) * r;
+		p.v = random_direction(rng) * q * v_escape;
+		return p;
+	});
+}
+
+std::vector<particle> rotating_disk(const size_t &num_particles, const double &radius, const double &thickness, const double &gm,
+                                    const uint64_t &seed, const size_t &num_threads)
+{
+	return generate(num_particles, seed, num_threads, [&](philox_rng &rng)
+	{
+		const double r = radius * sqrt(rng.uniform());
+		const double angle = 2. * std::numbers::pi * rng.uniform();
+
+		particle p = {};
+		p.pos = {r * cos(angle), r * sin(angle), rng.normal(0, thickness)};
+
+		/* Circular velocity of the enclosed mass, treated as if it were spherically distributed. */
+		const double v = r > 0 ? sqrt(gm * (r / radius) * (r / radius) / r) : 0;
+		p.v = vec3<double>{sin(angle), -cos(angle), 0} * v;
+		return p;
+	});
+}
+
+std::vector<particle> generate_scene(const config &c)
+{
+	ASSERT_EX_M_PRINTF(c.scene == "sphere" || c.scene == "plummer" || c.scene == "disk",
+	                   "Unknown scene '%s', expected sphere, plummer or disk", c.scene.c_str());
+
+	uint64_t seed = c.seed;
+	if (seed == 0 && c.deterministic)
+	{
+		seed = config::default_seed;
+	}
+	else if (seed == 0)
+	{
+		std::random_device r;
+		seed = uint64_t{r()} << 32 | r();
+		INFO("Initial conditions seed: %llu", static_cast<unsigned long long>(seed));
+	}
+
+	const double radius = c.sim.size * 0.5 * c.generation_scale;
+	const double gm = c.sim.g_const * c.num_particles;
+
+	if (c.scene == "sphere")
+	{
+		return uniform_sphere(c.num_particles, radius, c.initial_velocity_factor, seed, c.sim.num_threads);
+	}
+	if (c.scene == "plummer")
+	{
+		return plummer_sphere(c.num_particles, radius * c.plummer_scale, radius, gm, seed, c.sim.num_threads);
+	}
+	return rotating_disk(c.num_particles, radius, radius * c.disk_thickness, gm, seed, c.sim.num_threads);
+}
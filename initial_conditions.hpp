@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "simulation.hpp"
+
+struct config;
+
+/* All generators draw particle i from its own stream of a counter-based generator, so the result
+ * depends only on the seed and not on num_threads (0 uses all hardware threads). */
+
+/* Uniform distribution inside the volume of a sphere centered at the origin, rotating around the z axis. */
+std::vector<particle> uniform_sphere(const size_t &num_particles, const double &radius, const double &initial_velocity_factor,
+                                     const uint64_t &seed, const size_t &num_threads);
+
+/* Plummer sphere truncated at max_radius with isotropic velocities drawn from its distribution
+ * function. gm is the total mass times the gravitational constant. */
+std::vector<particle> plummer_sphere(const size_t &num_particles, const double &scale_radius, const double &max_radius, const double &gm,
+                                     const uint64_t &seed, const size_t &num_threads);
+
+/* Disk of uniform surface density in the xy plane with gaussian thickness, on circular orbits around the z axis. */
+std::vector<particle> rotating_disk(const size_t &num_particles, const double &radius, const double &thickness, const double &gm,
+                                    const uint64_t &seed, const size_t &num_threads);
+
+/* Generates the scene selected by c.scene. A zero seed is replaced by a random one, which is logged,
+ * or by config::default_seed in deterministic mode. */
+std::vector<particle> generate_scene(const config &c);
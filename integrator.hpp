@@ -0,0 +1,69 @@
+#pragma once
+#include <array>
+#include <cmath>
+
+#include "math.hpp"
+
+/* The integrator is chosen at compile time (PARTICLES_INTEGRATOR in CMake) so that the
+ * integration loop in simulation::calculate_physics stays branch-free.
+ *
+ * A step is split into substeps; each substep is one force evaluation followed by
+ * advance() with dt scaled by the substep weight. dt_prev is the scaled dt of the
+ * previous substep (0 before the first one), which lets the kick-drift-kick leapfrog
+ * merge the closing half-kick of one substep with the opening half-kick of the next.
+ * Velocities held by the particles are therefore half a substep behind the positions.
+ *
+ * order is the global order of the position error, checked by particles_convergence. */
+
+/* Second order Taylor expansion using only the current acceleration. Not symplectic. */
+struct taylor_integrator
+{
+	static constexpr const char *name = "taylor";
+	static constexpr int order = 1;
+	static constexpr std::array<double, 1> substeps = {1.0};
+
+	static void advance(vec3<double> &pos, vec3<double> &v, const vec3<double> &a, const double &, const double &dt)
+	{
+		pos = pos + v * dt + a * dt * dt * 0.5;
+		v = v + a * dt;
+	}
+};
+
+/* Kick-drift-kick leapfrog, second order symplectic. */
+struct leapfrog_integrator
+{
+	static constexpr const char *name = "leapfrog";
+	static constexpr int order = 2;
+	static constexpr std::array<double, 1> substeps = {1.0};
+
+	static void advance(vec3<double> &pos, vec3<double> &v, const vec3<double> &a, const double &dt_prev, const double &dt)
+	{
+		v = v + a * ((dt_prev + dt) * 0.5);
+		pos = pos + v * dt;
+	}
+};
+
+/* Yoshida's fourth order composition of three leapfrog substeps:
+ * https://doi.org/10.1016/0375-9601(90)90092-3 */
+struct yoshida4_integrator
+{
+	static constexpr const char *name = "yoshida4";
+	static constexpr int order = 4;
+	static constexpr double cbrt2 = 1.25992104989487316476;
+	static constexpr double w1 = 1. / (2. - cbrt2);
+	static constexpr double w0 = -cbrt2 / (2. - cbrt2);
+	static constexpr std::array<double, 3> substeps = {w1, w0, w1};
+
+	static void advance(vec3<double> &pos, vec3<double> &v, const vec3<double> &a, const double &dt_prev, const double &dt)
+	{
+		leapfrog_integrator::advance(pos, v, a, dt_prev, dt);
+	}
+};
+
+#if defined(PARTICLES_INTEGRATOR_TAYLOR)
+using integrator = taylor_integrator;
+#elif defined(PARTICLES_INTEGRATOR_YOSHIDA4)
+using integrator = yoshida4_integrator;
+#else
+using integrator = leapfrog_integrator;
+#endif
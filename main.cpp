@@ -1,11 +1,19 @@
 #include "helper.hpp"
 #include "application.hpp"
 
-int main()
+int main(int argc, char **argv)
 {
 	try
 	{
-		application application;
+		config cfg;
+		cfg.load(argc, argv);
+		if (cfg.help)
+		{
+			config::print_usage(argv[0]);
+			return 0;
+		}
+
+		application application(cfg);
 		application.run();
 	}
 	catch(const std::exception &ex)
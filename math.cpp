@@ -1,18 +1,27 @@
 #include <random>
+#include <atomic>
 #include "math.hpp"
+#include "random.hpp"
 
-static std::random_device r;
-static std::seed_seq seed{r(), r(), r(), r(), r(), r(), r(), r()};
-static std::mt19937_64 engine(seed);
+/* One stream of the same randomly seeded generator per thread. */
+static philox_rng &thread_engine()
+{
+	static const uint64_t seed = []
+	{
+		std::random_device r;
+		return uint64_t{r()} << 32 | r();
+	}();
+	static std::atomic_uint64_t next_stream = 0;
+	thread_local philox_rng engine(seed, next_stream++);
+	return engine;
+}
 
 double uniform_random_double(double from, double to)
 {
-	std::uniform_real_distribution dis(from, to);
-	return dis(engine);
+	return thread_engine().uniform(from, to);
 }
 
 double normal_random_double(double mean, double stddev)
 {
-	std::normal_distribution dis(mean, stddev);
-	return dis(engine);
+	return thread_engine().normal(mean, stddev);
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <cassert>
+#include <array>
 #include <cmath>
 #include <numbers>
 
@@ -145,6 +146,17 @@ struct mat4
 		}
 		return res;
 	}
+
+	/* x, y, z, w of this * (p, 1). */
+	std::array<float, 4> transform(const vec3<float> &p) const
+	{
+		std::array<float, 4> res;
+		for (int i = 0; i < 4; i++)
+		{
+			res[i] = values[i][0] * p.x + values[i][1] * p.y + values[i][2] * p.z + values[i][3];
+		}
+		return res;
+	}
 };
 
 template<typename T>
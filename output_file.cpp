@@ -0,0 +1,173 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "output_file.hpp"
+#include "helper.hpp"
+
+output_file::output_file(const std::string &path, const bool &direct, const size_t &batch_size) : m_path(path)
+{
+	m_capacity = std::max((batch_size + alignment - 1) / alignment, size_t{1}) * alignment;
+	m_buffer.reset(static_cast<unsigned char *>(std::aligned_alloc(alignment, m_capacity)));
+	if (!m_buffer)
+	{
+		THROW("Failed to allocate the output buffer");
+	}
+
+#if defined(__unix__) || defined(__APPLE__)
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+	if (direct)
+	{
+		m_fd = open(path.c_str(), flags | O_DIRECT, 0644);
+		m_direct = m_fd >= 0;
+	}
+#endif
+	if (m_fd < 0)
+	{
+		m_fd = open(path.c_str(), flags, 0644);
+	}
+	if (m_fd < 0)
+	{
+		THROW_PRINTF("Failed to create '%s'", path.c_str());
+	}
+#ifdef F_NOCACHE
+	if (direct)
+	{
+		m_direct = fcntl(m_fd, F_NOCACHE, 1) == 0;
+	}
+#endif
+#else
+	m_file = std::fopen(path.c_str(), "wb");
+	if (m_file == nullptr)
+	{
+		THROW_PRINTF("Failed to create '%s'", path.c_str());
+	}
+#endif
+}
+
+output_file::~output_file()
+{
+	try
+	{
+		close();
+	}
+	catch (const std::exception &ex)
+	{
+		ERROR("%s", ex.what());
+	}
+}
+
+void output_file::disable_direct()
+{
+#if (defined(__unix__) || defined(__APPLE__)) && defined(O_DIRECT)
+	if (m_direct)
+	{
+		fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+	}
+#endif
+	m_direct = false;
+}
+
+void output_file::write_all(const unsigned char *data, const size_t &size)
+{
+#if defined(__unix__) || defined(__APPLE__)
+	size_t done = 0;
+	while (done < size)
+	{
+		const ssize_t res = ::write(m_fd, data + done, size - done);
+		if (res < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			/* Some file systems accept O_DIRECT at open time but reject the writes. */
+			if (errno == EINVAL && m_direct && done == 0)
+			{
+				disable_direct();
+				continue;
+			}
+			THROW_PRINTF("Failed to write '%s': %s", m_path.c_str(), std::strerror(errno));
+		}
+		done += static_cast<size_t>(res);
+	}
+#else
+	if (std::fwrite(data, 1, size, m_file) != size)
+	{
+		THROW_PRINTF("Failed to write '%s'", m_path.c_str());
+	}
+#endif
+	m_flushed += size;
+}
+
+void output_file::flush_aligned()
+{
+	/* Direct I/O needs block-aligned sizes, the unaligned tail waits for more data or close(). */
+	const size_t size = m_direct ? m_size / alignment * alignment : m_size;
+	write_all(m_buffer.get(), size);
+	std::memmove(m_buffer.get(), m_buffer.get() + size, m_size - size);
+	m_size -= size;
+}
+
+void output_file::write(const void *data, size_t size)
+{
+	const unsigned char *src = static_cast<const unsigned char *>(data);
+	while (size > 0)
+	{
+		const size_t num = std::min(size, m_capacity - m_size);
+		std::memcpy(m_buffer.get() + m_size, src, num);
+		m_size += num;
+		src += num;
+		size -= num;
+
+		if (m_size == m_capacity)
+		{
+			flush_aligned();
+		}
+	}
+}
+
+void output_file::close()
+{
+#if defined(__unix__) || defined(__APPLE__)
+	if (m_fd < 0)
+	{
+		return;
+	}
+#else
+	if (m_file == nullptr)
+	{
+		return;
+	}
+#endif
+
+	flush_aligned();
+	if (m_size > 0)
+	{
+		disable_direct();
+		write_all(m_buffer.get(), m_size);
+		m_size = 0;
+	}
+
+#if defined(__unix__) || defined(__APPLE__)
+	const int fd = m_fd;
+	m_fd = -1;
+	if (::close(fd) != 0)
+	{
+		THROW_PRINTF("Failed to close '%s'", m_path.c_str());
+	}
+#else
+	std::FILE *const file = m_file;
+	m_file = nullptr;
+	if (std::fclose(file) != 0)
+	{
+		THROW_PRINTF("Failed to close '%s'", m_path.c_str());
+	}
+#endif
+}
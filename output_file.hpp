@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+/* Sequential output file written in large batches.
+ *
+ * Data is staged in an aligned buffer and handed to the OS in batch_size chunks. With
+ * direct = true the writes bypass the page cache (O_DIRECT on Linux, F_NOCACHE on macOS)
+ * when the platform and file system allow it, otherwise regular writes are used. */
+class output_file
+{
+private:
+	static constexpr size_t alignment = 4096;
+
+	struct free_deleter
+	{
+		void operator()(unsigned char *p) const
+		{
+			std::free(p);
+		}
+	};
+
+	std::string m_path;
+	std::unique_ptr<unsigned char, free_deleter> m_buffer;
+	size_t m_capacity = 0;
+	size_t m_size = 0;
+	uint64_t m_flushed = 0;
+	bool m_direct = false;
+#if defined(__unix__) || defined(__APPLE__)
+	int m_fd = -1;
+#else
+	std::FILE *m_file = nullptr;
+#endif
+
+	void write_all(const unsigned char *data, const size_t &size);
+	void flush_aligned();
+	void disable_direct();
+
+public:
+	output_file(const std::string &path, const bool &direct, const size_t &batch_size = 8 << 20);
+	~output_file();
+
+	output_file(const output_file &) = delete;
+	output_file &operator=(const output_file &) = delete;
+
+	void write(const void *data, size_t size);
+
+	/* Writes the remaining data and closes the file. Called by the destructor if needed. */
+	void close();
+
+	uint64_t get_offset() const
+	{
+		return m_flushed + m_size;
+	}
+
+	bool is_direct() const
+	{
+		return m_direct;
+	}
+};
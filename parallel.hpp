@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+/* Splits [0, num) into one contiguous range per thread, calls f(begin, end) for each on its own
+ * thread and waits for all of them. */
+template <typename F>
+void parallel_for(const size_t &num_threads, const size_t &num, F &&f)
+{
+	const size_t chunk = (num + std::max<size_t>(num_threads, 1) - 1) / std::max<size_t>(num_threads, 1);
+	std::vector<std::thread> threads;
+	for (size_t begin = 0; begin < num; begin += chunk)
+	{
+		threads.emplace_back([&f, begin, end = std::min(begin + chunk, num)]
+							 { f(begin, end); });
+	}
+	for (std::thread &t : threads)
+	{
+		t.join();
+	}
+}
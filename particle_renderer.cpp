@@ -1,8 +1,13 @@
 #include <vector>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <thread>
 
 #include "particle_renderer.hpp"
 #include "math.hpp"
 #include "helper.hpp"
+#include "parallel.hpp"
 
 GLuint particle_renderer::compile_shader(const char *shader_source, GLenum type)
 {
@@ -52,25 +57,34 @@ GLuint particle_renderer::link_shader_program(const std::vector<GLuint> shaders)
 	return program;
 }
 
-particle_renderer::particle_renderer(const window *const wnd, const simulation *const sim, const float &particle_scale, const float &fov) : m_wnd(wnd), m_sim(sim), m_particle_scale(particle_scale), m_fov(fov)
+particle_renderer::particle_renderer(const window *const wnd, const simulation *const sim, const float &particle_scale, const float &fov, const float &lod_threshold,
+                                     const bool &extrapolate) :
+	m_wnd(wnd), m_sim(sim), m_lod_threshold(lod_threshold), m_extrapolate(extrapolate), m_particle_scale(particle_scale), m_fov(fov)
 {
 	const char *vertex_shader_source = "#version 410 core\n"
 									   "layout (location = 0) in vec3 aPos;\n"
+									   "layout (location = 1) in float aWeight;\n"
+									   "layout (location = 2) in vec3 aVelocity;\n"
 									   "uniform mat4 World;\n"
 									   "uniform mat4 View;\n"
 									   "uniform mat4 Projection;\n"
 									   "uniform float ParticleSize;\n"
+									   "uniform float Extrapolation;\n"
+									   "out float Weight;\n"
 									   "void main()\n"
 									   "{\n"
-									   "   vec4 pos = Projection * View * World * vec4(aPos, 1.0);\n"
+									   "   vec4 pos = Projection * View * World * vec4(aPos + aVelocity * Extrapolation, 1.0);\n"
 									   "   gl_Position = pos;\n"
 									   "   gl_PointSize = ParticleSize / pos.w;\n"
+									   "   Weight = aWeight;\n"
 									   "}\0";
+	/* An impostor of n particles is as opaque as n overlapping particles. */
 	const char *fragment_shader_source = "#version 410 core\n"
+										 "in float Weight;\n"
 										 "out vec4 FragColor;\n"
 										 "void main()\n"
 										 "{\n"
-										 "   FragColor = vec4(1.0f, 1.0f, 1.0f, 0.025f);\n"
+										 "   FragColor = vec4(1.0f, 1.0f, 1.0f, 1.0f - pow(1.0f - 0.025f, Weight));\n"
 										 "}\n\0";
 
 	const GLuint vertex_shader = compile_shader(vertex_shader_source, GL_VERTEX_SHADER);
@@ -88,16 +102,25 @@ particle_renderer::particle_renderer(const window *const wnd, const simulation *
 
 	gl.BindVertexArray(m_VAO);
 
-	gl.BindBuffer(GL_ARRAY_BUFFER, m_VBO);
-	gl.BufferData(GL_ARRAY_BUFFER, sizeof(vec3<float>) * m_sim->get_num_particles(), nullptr, GL_DYNAMIC_DRAW);
+	m_persistent = gl.VERSION_4_4;
+	reserve(m_sim->get_num_particles());
 
-	gl.VertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vec3<float>), (void *)0);
+	gl.GenVertexArrays(1, &m_impostor_VAO);
+	gl.GenBuffers(1, &m_impostor_VBO);
+	gl.BindVertexArray(m_impostor_VAO);
+	gl.BindBuffer(GL_ARRAY_BUFFER, m_impostor_VBO);
+	gl.VertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(impostor), (void *)offsetof(impostor, pos));
 	gl.EnableVertexAttribArray(0);
+	gl.VertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(impostor), (void *)offsetof(impostor, weight));
+	gl.EnableVertexAttribArray(1);
+	gl.VertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(impostor), (void *)offsetof(impostor, v));
+	gl.EnableVertexAttribArray(2);
 
 	m_world_uniform = gl.GetUniformLocation(m_shader_program, "World");
 	m_view_uniform = gl.GetUniformLocation(m_shader_program, "View");
 	m_projection_uniform = gl.GetUniformLocation(m_shader_program, "Projection");
 	m_particle_size_uniform = gl.GetUniformLocation(m_shader_program, "ParticleSize");
+	m_extrapolation_uniform = gl.GetUniformLocation(m_shader_program, "Extrapolation");
 }
 
 void particle_renderer::clean() noexcept
@@ -116,6 +139,26 @@ void particle_renderer::move(particle_renderer &&other) noexcept
 	m_view_uniform = other.m_view_uniform;
 	m_projection_uniform = other.m_projection_uniform;
 	m_particle_size_uniform = other.m_particle_size_uniform;
+	m_persistent = other.m_persistent;
+	m_capacity = other.m_capacity;
+	m_mapped = other.m_mapped;
+	m_fences = other.m_fences;
+	m_region = other.m_region;
+	m_generation = other.m_generation;
+	m_snapshot = other.m_snapshot;
+	m_impostor_VBO = other.m_impostor_VBO;
+	m_impostor_VAO = other.m_impostor_VAO;
+	m_lod_threshold = other.m_lod_threshold;
+	m_extrapolate = other.m_extrapolate;
+	m_snapshot_arrival = other.m_snapshot_arrival;
+	m_snapshot_sim_time = other.m_snapshot_sim_time;
+	m_sim_rate = other.m_sim_rate;
+	m_snapshot_interval = other.m_snapshot_interval;
+	m_extrapolation_uniform = other.m_extrapolation_uniform;
+	m_view_matrix = other.m_view_matrix;
+	m_projection_matrix = other.m_projection_matrix;
+	m_dirty = other.m_dirty;
+	m_viewport_size = other.m_viewport_size;
 	m_world_matrix = other.m_world_matrix;
 	m_particle_scale = other.m_particle_scale;
 	m_fov = other.m_fov;
@@ -129,8 +172,10 @@ void particle_renderer::safe_destroy() noexcept
 	if (m_wnd)
 	{
 		const auto &gl = m_wnd->gl();
+		release_buffer();
 		gl.DeleteVertexArrays(1, &m_VAO);
-		gl.DeleteBuffers(1, &m_VBO);
+		gl.DeleteVertexArrays(1, &m_impostor_VAO);
+		gl.DeleteBuffers(1, &m_impostor_VBO);
 		gl.DeleteProgram(m_shader_program);
 	}
 
@@ -155,6 +200,91 @@ particle_renderer::~particle_renderer()
 	safe_destroy();
 }
 
+void particle_renderer::release_buffer() noexcept
+{
+	const auto &gl = m_wnd->gl();
+	for (GLsync &fence : m_fences)
+	{
+		if (fence)
+		{
+			gl.DeleteSync(fence);
+			fence = nullptr;
+		}
+	}
+
+	if (m_mapped)
+	{
+		gl.BindBuffer(GL_ARRAY_BUFFER, m_VBO);
+		gl.UnmapBuffer(GL_ARRAY_BUFFER);
+		m_mapped = nullptr;
+	}
+
+	gl.DeleteBuffers(1, &m_VBO);
+	m_VBO = 0;
+	m_capacity = 0;
+}
+
+void particle_renderer::reserve(const size_t &num)
+{
+	if (num <= m_capacity && m_VBO)
+	{
+		return;
+	}
+
+	/* Deleting the buffer is safe while the GPU still draws from it, GL keeps it alive until then. */
+	release_buffer();
+	m_capacity = std::max<size_t>({num, m_capacity * 3 / 2, 1});
+
+	const auto &gl = m_wnd->gl();
+	gl.BindVertexArray(m_VAO);
+	gl.GenBuffers(1, &m_VBO);
+	gl.BindBuffer(GL_ARRAY_BUFFER, m_VBO);
+
+	if (m_persistent)
+	{
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		const GLsizeiptr size = sizeof(simulation::render_vertex) * m_capacity * m_ring_size;
+		gl.BufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+		m_mapped = static_cast<simulation::render_vertex *>(gl.MapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+		ASSERT_EX_M(m_mapped, "Failed to map the particle vertex buffer");
+	}
+	else
+	{
+		gl.BufferData(GL_ARRAY_BUFFER, sizeof(simulation::render_vertex) * m_capacity, nullptr, GL_STREAM_DRAW);
+	}
+
+	gl.VertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(simulation::render_vertex), (void *)offsetof(simulation::render_vertex, pos));
+	gl.EnableVertexAttribArray(0);
+	gl.VertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(simulation::render_vertex), (void *)offsetof(simulation::render_vertex, v));
+	gl.EnableVertexAttribArray(2);
+}
+
+simulation::render_vertex *particle_renderer::acquire_region(const size_t &num)
+{
+	reserve(num);
+
+	const auto &gl = m_wnd->gl();
+	if (!m_persistent)
+	{
+		/* Orphaning: the driver hands out fresh storage instead of waiting for the previous draw. */
+		gl.BufferData(GL_ARRAY_BUFFER, sizeof(simulation::render_vertex) * m_capacity, nullptr, GL_STREAM_DRAW);
+		return static_cast<simulation::render_vertex *>(gl.MapBufferRange(GL_ARRAY_BUFFER, 0, sizeof(simulation::render_vertex) * num,
+		                                                     GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+	}
+
+	m_region = (m_region + 1) % m_ring_size;
+	GLsync &fence = m_fences[m_region];
+	if (fence)
+	{
+		while (gl.ClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+		{
+		}
+		gl.DeleteSync(fence);
+		fence = nullptr;
+	}
+	return m_mapped + m_region * m_capacity;
+}
+
 void particle_renderer::configure_pipeline()
 {
 	const auto &gl = m_wnd->gl();
@@ -162,6 +292,7 @@ void particle_renderer::configure_pipeline()
 	gl.UseProgram(m_shader_program);
 
 	const dimensions viewport_size = m_wnd->get_framebuffer_size();
+	m_viewport_size = viewport_size;
 	gl.Enable(GL_BLEND);
 	gl.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	gl.Enable(GL_MULTISAMPLE);
@@ -171,35 +302,216 @@ void particle_renderer::configure_pipeline()
 	const double sim_size = m_sim->get_size();
 	const float distance = sim_size * 0.5f / sinf(m_fov * 0.5) * m_camera_zoom;
 	const mat4<float> view_matrix = look_to_matrix({0, 0, -distance}, {0, 0, 1}, {0, 1, 0});
+	m_view_matrix = view_matrix;
 
 	const mat4<float> projection_matrix = perspective_projection_matrix(m_fov, std::max((distance - sim_size * 0.5) * 0.9, 0.1), (distance + sim_size * 0.5) * 1.1, (float)viewport_size.width / viewport_size.height);
+	m_projection_matrix = projection_matrix;
 	gl.UniformMatrix4fv(m_world_uniform, 1, GL_TRUE, reinterpret_cast<const GLfloat *>(&m_world_matrix));
 	gl.UniformMatrix4fv(m_view_uniform, 1, GL_TRUE, reinterpret_cast<const GLfloat *>(&view_matrix));
 	gl.UniformMatrix4fv(m_projection_uniform, 1, GL_TRUE, reinterpret_cast<const GLfloat *>(&projection_matrix));
 	gl.Uniform1f(m_particle_size_uniform, m_sim->get_particle_size() * viewport_size.height / tanf(m_fov / 2) * m_particle_scale);
 }
 
+size_t particle_renderer::select_cells()
+{
+	m_ranges.clear();
+	m_impostors.clear();
+
+	const std::vector<simulation::render_node> &nodes = m_snapshot->nodes;
+	if (nodes.empty())
+	{
+		m_ranges.push_back({0, static_cast<uint32_t>(m_snapshot->vertices.size())});
+		return m_snapshot->vertices.size();
+	}
+
+	/* Length at unit depth to pixels. */
+	const float pixels_per_unit = m_viewport_size.height * 0.5f / tanf(m_fov * 0.5f);
+	const mat4<float> transform = m_world_matrix * m_view_matrix * m_projection_matrix;
+
+	/* Frustum planes from the rows of the world to clip space transform (Gribb & Hartmann),
+	 * the inside of each is a * x + b * y + c * z + d >= 0. */
+	std::array<std::array<float, 4>, 6> planes;
+	for (int i = 0; i < 3; ++i)
+	{
+		for (int j = 0; j < 4; ++j)
+		{
+			planes[i * 2][j] = transform.values[3][j] + transform.values[i][j];
+			planes[i * 2 + 1][j] = transform.values[3][j] - transform.values[i][j];
+		}
+	}
+	const auto is_visible = [&planes](const cube<float> &c)
+	{
+		for (const std::array<float, 4> &p : planes)
+		{
+			const float distance = p[0] * c.pos.x + p[1] * c.pos.y + p[2] * c.pos.z + p[3];
+			const float radius = c.half_size * (fabsf(p[0]) + fabsf(p[1]) + fabsf(p[2]));
+			if (distance < -radius)
+			{
+				return false;
+			}
+		}
+		return true;
+	};
+
+	size_t num = 0;
+	uint32_t i = 0;
+	while (i < nodes.size())
+	{
+		const simulation::render_node &node = nodes[i];
+		if (node.num_particles == 0 || !is_visible(node.bounds))
+		{
+			i = node.next;
+			continue;
+		}
+
+		const float depth = transform.transform(node.bounds.pos)[3];
+		const float projected_size = node.bounds.half_size * 2 * pixels_per_unit / depth;
+		if (depth > node.bounds.half_size * 2 && projected_size < m_lod_threshold)
+		{
+			m_impostors.push_back({node.center_of_mass, static_cast<float>(node.num_particles), node.mean_velocity});
+		}
+		else if (node.next == i + 1)
+		{
+			/* Neighbouring leafs are merged into one range. */
+			if (!m_ranges.empty() && m_ranges.back().first + m_ranges.back().second == node.first)
+			{
+				m_ranges.back().second += node.num_particles;
+			}
+			else
+			{
+				m_ranges.push_back({node.first, node.num_particles});
+			}
+			num += node.num_particles;
+		}
+		else
+		{
+			++i;
+			continue;
+		}
+		i = node.next;
+	}
+	return num;
+}
+
+void particle_renderer::copy_ranges(simulation::render_vertex *vertices, const size_t &num) const
+{
+	const simulation::render_vertex *source = m_snapshot->vertices.data();
+
+	/* Copies [begin, end) of the concatenated ranges. */
+	const auto copy = [&](const size_t &begin, const size_t &end)
+	{
+		size_t offset = 0;
+		for (const auto &[first, count] : m_ranges)
+		{
+			const size_t from = std::max<size_t>(begin, offset);
+			const size_t to = std::min<size_t>(end, offset + count);
+			if (from < to)
+			{
+				std::memcpy(vertices + from, source + first + (from - offset), sizeof(simulation::render_vertex) * (to - from));
+			}
+			offset += count;
+			if (offset >= end)
+			{
+				break;
+			}
+		}
+	};
+
+	const size_t num_threads = std::min<size_t>(std::thread::hardware_concurrency(), m_max_copy_threads);
+	if (num < m_parallel_copy_min || num_threads < 2)
+	{
+		copy(0, num);
+		return;
+	}
+	parallel_for(num_threads, num, copy);
+}
+
 void particle_renderer::render()
 {
 	const auto &gl = m_wnd->gl();
 	gl.Clear(GL_COLOR_BUFFER_BIT);
+	m_dirty = false;
 
-	vec3<float> *points = static_cast<vec3<float> *>(gl.MapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY));
-	const std::vector<vec3<double>> &particles = m_sim->get_particles_positions();
+	if (m_sim->get_render_generation() != m_generation)
+	{
+		const bool had_snapshot = m_snapshot != nullptr;
+		m_snapshot = &m_sim->get_render_snapshot(m_generation);
+
+		const clock::time_point now = clock::now();
+		const double sim_elapsed = m_snapshot->sim_time - m_snapshot_sim_time;
+		const double wall_elapsed = std::chrono::duration<double>(now - m_snapshot_arrival).count();
+		if (had_snapshot && sim_elapsed > 0 && wall_elapsed > 0)
+		{
+			/* Smoothed, a single late snapshot shouldn't make the motion jump. */
+			const double rate = sim_elapsed / wall_elapsed;
+			m_sim_rate = m_sim_rate > 0 ? m_sim_rate * 0.8 + rate * 0.2 : rate;
+			m_snapshot_interval = sim_elapsed;
+		}
+		else
+		{
+			m_snapshot_interval = 0;
+		}
+		m_snapshot_arrival = now;
+		m_snapshot_sim_time = m_snapshot->sim_time;
+	}
+	if (m_snapshot == nullptr || m_snapshot->vertices.empty())
+	{
+		return;
+	}
 
-	const double sim_half_size = m_sim->get_size() / 2;
-	const dimensions viewport_size = m_wnd->get_framebuffer_size();
+	gl.Uniform1f(m_extrapolation_uniform, extrapolation_time());
+
+	const size_t num = select_cells();
+	if (num > 0)
+	{
+		gl.BindBuffer(GL_ARRAY_BUFFER, m_VBO);
+		simulation::render_vertex *vertices = acquire_region(num);
+		ASSERT_EX_M(vertices, "Failed to map the particle vertex buffer");
+		copy_ranges(vertices, num);
+
+		gl.VertexAttrib1f(1, 1.0f);
+		if (m_persistent)
+		{
+			gl.DrawArrays(GL_POINTS, m_region * m_capacity, num);
+
+			m_fences[m_region] = gl.FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+		else
+		{
+			gl.UnmapBuffer(GL_ARRAY_BUFFER);
+			gl.DrawArrays(GL_POINTS, 0, num);
+		}
+	}
 
-	for (size_t i = 0; i < particles.size(); ++i)
+	if (!m_impostors.empty())
 	{
-		points[i] = vec3<float>::type_cast(particles[i]);
+		gl.BindVertexArray(m_impostor_VAO);
+		gl.BindBuffer(GL_ARRAY_BUFFER, m_impostor_VBO);
+		gl.BufferData(GL_ARRAY_BUFFER, sizeof(impostor) * m_impostors.size(), m_impostors.data(), GL_STREAM_DRAW);
+		gl.DrawArrays(GL_POINTS, 0, m_impostors.size());
+		gl.BindVertexArray(m_VAO);
 	}
-	gl.UnmapBuffer(GL_ARRAY_BUFFER);
+}
 
-	gl.DrawArrays(GL_POINTS, 0, particles.size());
+double particle_renderer::extrapolation_time() const
+{
+	if (!m_extrapolate)
+	{
+		return 0;
+	}
+	const double wall_elapsed = std::chrono::duration<double>(clock::now() - m_snapshot_arrival).count();
+	return std::min(wall_elapsed * m_sim_rate, m_snapshot_interval);
+}
+
+bool particle_renderer::needs_redraw() const
+{
+	const dimensions viewport_size = m_wnd->get_framebuffer_size();
+	return m_dirty || viewport_size.width != m_viewport_size.width || viewport_size.height != m_viewport_size.height ||
+		   m_sim->get_render_generation() != m_generation || (m_extrapolate && extrapolation_time() < m_snapshot_interval);
 }
 
 void particle_renderer::rotate_world(const vec2<float> &delta)
 {
 	m_world_matrix = m_world_matrix * x_rotation_matrix(delta.y) * y_rotation_matrix(delta.x);
+	m_dirty = true;
 }
@@ -1,4 +1,7 @@
 #pragma once
+#include <array>
+#include <chrono>
+
 #include "window.hpp"
 #include "simulation.hpp"
 #include "math.hpp"
@@ -11,6 +14,52 @@ private:
 	GLuint m_shader_program = 0;
 	GLuint m_VBO = 0;
 	GLuint m_VAO = 0;
+	/* The VBO holds m_ring_size regions of m_capacity vertices. Each frame writes the next region
+	 * while the GPU may still be drawing from the others; a fence per region guards reuse. Without
+	 * persistent mapping (GL 4.4) there is a single region, orphaned every frame. */
+	static constexpr uint8_t m_ring_size = 3;
+	bool m_persistent = false;
+	size_t m_capacity = 0;
+	simulation::render_vertex *m_mapped = nullptr;
+	std::array<GLsync, m_ring_size> m_fences = {};
+	uint8_t m_region = 0;
+	/* Render generation of the current snapshot. */
+	uint64_t m_generation = 0;
+	const simulation::render_snapshot *m_snapshot = nullptr;
+	/* Cells outside the view frustum are skipped. Cells projected smaller than m_lod_threshold
+	 * pixels are drawn as a single point weighted by their particle count. Only the particles of
+	 * the remaining leafs, m_ranges of the snapshot vertices, are copied to the VBO. */
+	struct impostor
+	{
+		vec3<float> pos;
+		float weight;
+		vec3<float> v;
+	};
+	GLuint m_impostor_VBO = 0;
+	GLuint m_impostor_VAO = 0;
+	float m_lod_threshold;
+	std::vector<impostor> m_impostors;
+	std::vector<std::pair<uint32_t, uint32_t>> m_ranges;
+	/* The copy is split across threads from this many vertices on; below, starting the threads
+	 * costs more than they save. A few threads already saturate memory bandwidth. */
+	static constexpr size_t m_parallel_copy_min = size_t{1} << 18;
+	static constexpr size_t m_max_copy_threads = 4;
+	mat4<float> m_view_matrix = identity_matrix();
+	mat4<float> m_projection_matrix = identity_matrix();
+	/* Between snapshots, positions are extrapolated along the velocities in the vertex shader by the
+	 * simulated time estimated to have passed since the snapshot arrived, at most one snapshot
+	 * interval. Frames then advance smoothly at display rate while the simulation is slower. */
+	using clock = std::chrono::steady_clock;
+	bool m_extrapolate;
+	clock::time_point m_snapshot_arrival;
+	double m_snapshot_sim_time = 0;
+	/* Simulated seconds per wall-clock second, and the simulated time between the last two snapshots. */
+	double m_sim_rate = 0;
+	double m_snapshot_interval = 0;
+	GLint m_extrapolation_uniform = -1;
+	/* Set when the camera or the viewport changed since the last frame. */
+	bool m_dirty = true;
+	dimensions m_viewport_size;
 	GLint m_world_uniform = -1;
 	GLint m_view_uniform = -1;
 	GLint m_projection_uniform = -1;
@@ -23,13 +72,26 @@ private:
 	GLuint compile_shader(const char *shader_source, GLenum type);
 	GLuint link_shader_program(const std::vector<GLuint> shaders);
 
+	/* Reallocates the VBO when num vertices don't fit in a region. */
+	void reserve(const size_t &num);
+	void release_buffer() noexcept;
+	/* Returns the region to write the next frame to, once the GPU is done reading it. */
+	simulation::render_vertex *acquire_region(const size_t &num);
+	/* Fills m_ranges and m_impostors for the current camera and returns the number of particles in m_ranges. */
+	size_t select_cells();
+	/* Copies the num vertices of m_ranges to vertices, in parallel for large frames. */
+	void copy_ranges(simulation::render_vertex *vertices, const size_t &num) const;
+	/* Simulated time to extrapolate the current snapshot by. */
+	double extrapolation_time() const;
+
 	void safe_destroy() noexcept;
 	void clean() noexcept;
 	void move(particle_renderer&& other) noexcept;
 
 public:
 	particle_renderer() = default;
-	particle_renderer(const window *const wnd, const simulation *const sim, const float &particle_scale, const float &fov);
+	particle_renderer(const window *const wnd, const simulation *const sim, const float &particle_scale, const float &fov, const float &lod_threshold,
+	                  const bool &extrapolate);
 	particle_renderer(particle_renderer &&other) noexcept;
 	~particle_renderer();
 
@@ -38,16 +100,21 @@ public:
 	void configure_pipeline();
 	void render();
 
+	/* False when neither the snapshot, its extrapolation nor the camera changed, so the last frame is still valid. */
+	bool needs_redraw() const;
+
 	void rotate_world(const vec2<float> &delta);
 
 	void set_particle_scale(const float &scale)
 	{
 		m_particle_scale = scale;
+		m_dirty = true;
 	}
 
 	void set_zoom(const float &zoom)
 	{
 		m_camera_zoom = zoom;
+		m_dirty = true;
 	}
 
 	float get_zoom() const
@@ -0,0 +1,128 @@
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "perf_counters.hpp"
+#include "helper.hpp"
+
+#if defined(__linux__)
+namespace
+{
+	int open_counter(const uint32_t &type, const uint64_t &config, const int &group)
+	{
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.disabled = group < 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		/* pid 0 and cpu -1: the calling thread on any CPU. */
+		return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+	}
+}
+#endif
+
+perf_counters::perf_counters()
+{
+	m_fds.fill(-1);
+	m_slots.fill(-1);
+
+#if defined(__linux__)
+	static const std::array<std::pair<uint32_t, uint64_t>, num_counters> events = {{
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	}};
+
+	int error = 0;
+	for (size_t i = 0; i < num_counters; ++i)
+	{
+		m_fds[i] = open_counter(events[i].first, events[i].second, m_leader);
+		if (m_fds[i] < 0)
+		{
+			error = errno;
+			continue;
+		}
+		if (m_leader < 0)
+		{
+			m_leader = m_fds[i];
+		}
+		m_slots[i] = m_num_opened++;
+	}
+
+	if (m_leader >= 0)
+	{
+		ioctl(m_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(m_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	static std::atomic_bool warned = false;
+	if (m_num_opened < num_counters && !warned.exchange(true))
+	{
+		WARNING("%d of %d hardware performance counters available (%s), check /proc/sys/kernel/perf_event_paranoid",
+		        m_num_opened, static_cast<int>(num_counters), std::strerror(error));
+	}
+#else
+	static std::atomic_bool warned = false;
+	if (!warned.exchange(true))
+	{
+		WARNING("Hardware performance counters are only supported on Linux");
+	}
+#endif
+}
+
+perf_counters::~perf_counters()
+{
+#if defined(__linux__)
+	for (const int &fd : m_fds)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+	}
+#endif
+}
+
+perf_counters::values perf_counters::read() const
+{
+	values result = {};
+#if defined(__linux__)
+	if (m_leader < 0)
+	{
+		return result;
+	}
+
+	/* PERF_FORMAT_GROUP: the number of counters followed by their values, in the order they were opened. */
+	std::array<uint64_t, num_counters + 1> buffer = {};
+	if (::read(m_leader, buffer.data(), sizeof(buffer)) <= 0)
+	{
+		return result;
+	}
+	for (size_t i = 0; i < num_counters; ++i)
+	{
+		if (m_slots[i] >= 0)
+		{
+			result[i] = buffer[1 + m_slots[i]];
+		}
+	}
+#endif
+	return result;
+}
+
+perf_counters &perf_counters::this_thread()
+{
+	thread_local perf_counters counters;
+	return counters;
+}
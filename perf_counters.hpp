@@ -0,0 +1,53 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+/* Hardware performance counters of the calling thread, read with Linux perf_event_open.
+ *
+ * The counters form one group, so they are always scheduled together and their ratios (e.g.
+ * instructions per cycle) stay meaningful even when the kernel multiplexes them. Only user space
+ * is counted, which perf_event_paranoid <= 2 allows without privileges. Counters the CPU or kernel
+ * doesn't provide read as 0, and without any of them (other platforms, containers without PMU
+ * access) the object is unavailable and read() returns zeros. */
+class perf_counters
+{
+public:
+	enum counter
+	{
+		cycles,
+		instructions,
+		llc_misses,
+		branch_misses,
+		num_counters
+	};
+
+	using values = std::array<uint64_t, num_counters>;
+
+	static constexpr const char *names[num_counters] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+
+private:
+	int m_leader = -1;
+	std::array<int, num_counters> m_fds;
+	/* Position of each opened counter in the group read, -1 if it couldn't be opened. */
+	std::array<int, num_counters> m_slots;
+	int m_num_opened = 0;
+
+public:
+	perf_counters();
+	~perf_counters();
+
+	perf_counters(const perf_counters &) = delete;
+	perf_counters &operator=(const perf_counters &) = delete;
+
+	bool is_available() const
+	{
+		return m_leader >= 0;
+	}
+
+	/* Counts since the counters were opened. */
+	values read() const;
+
+	/* Counters of the calling thread, opened on first use. Logs a warning the first time opening
+	 * fails in the process. */
+	static perf_counters &this_thread();
+};
@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdint>
+#include <array>
+#include <cmath>
+#include <numbers>
+
+/* Philox4x32-10 counter-based generator (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3").
+ * The output is a pure function of (key, counter), so independent streams need no shared state:
+ * the key is derived from the seed and the first half of the counter selects the stream. */
+class philox_rng
+{
+	std::array<uint32_t, 2> m_key;
+	std::array<uint32_t, 4> m_counter;
+	std::array<uint32_t, 4> m_output = {};
+	uint8_t m_output_index = 4;
+
+	static std::array<uint32_t, 4> round(const std::array<uint32_t, 4> &c, const std::array<uint32_t, 2> &k)
+	{
+		const uint64_t p0 = uint64_t{0xD2511F53} * c[0];
+		const uint64_t p1 = uint64_t{0xCD9E8D57} * c[2];
+		return {static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k[0], static_cast<uint32_t>(p1),
+				static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k[1], static_cast<uint32_t>(p0)};
+	}
+
+public:
+	static std::array<uint32_t, 4> generate(std::array<uint32_t, 4> counter, std::array<uint32_t, 2> key)
+	{
+		for (int i = 0; i < 10; ++i)
+		{
+			if (i > 0)
+			{
+				key[0] += 0x9E3779B9;
+				key[1] += 0xBB67AE85;
+			}
+			counter = round(counter, key);
+		}
+		return counter;
+	}
+
+	philox_rng(const uint64_t &seed, const uint64_t &stream) :
+		m_key{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)},
+		m_counter{static_cast<uint32_t>(stream), static_cast<uint32_t>(stream >> 32), 0, 0}
+	{
+	}
+
+	uint32_t next_u32()
+	{
+		if (m_output_index == 4)
+		{
+			m_output = generate(m_counter, m_key);
+			m_output_index = 0;
+			if (++m_counter[2] == 0)
+			{
+				++m_counter[3];
+			}
+		}
+		return m_output[m_output_index++];
+	}
+
+	uint64_t next_u64()
+	{
+		const uint64_t hi = next_u32();
+		return hi << 32 | next_u32();
+	}
+
+	/* Uniform in [0, 1) with 53 bits of precision. */
+	double uniform()
+	{
+		return static_cast<double>(next_u64() >> 11) * 0x1.0p-53;
+	}
+
+	double uniform(const double &from, const double &to)
+	{
+		return from + (to - from) * uniform();
+	}
+
+	/* Box-Muller; the second value of each pair is discarded so every call consumes the same amount of the stream. */
+	double normal(const double &mean, const double &stddev)
+	{
+		const double u1 = 1. - uniform();
+		const double u2 = uniform();
+		return mean + stddev * std::sqrt(-2. * std::log(u1)) * std::cos(2. * std::numbers::pi * u2);
+	}
+};
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "helper.hpp"
+#include "config.hpp"
+#include "initial_conditions.hpp"
+#include "output_file.hpp"
+#include "simulation.hpp"
+
+/* Strong and weak scaling of the worker pool.
+ *
+ * Runs --steps steps (after --warmup_steps) for every particle count and thread count and writes
+ * one CSV row per run. Strong scaling keeps the particle count of each run fixed while adding
+ * threads. Weak scaling multiplies it by the thread count, so every worker keeps the same number of
+ * particles. Efficiency is relative to the smallest thread count of the same series. Weak
+ * efficiency also includes the superlinear cost of the far field, which grows with the square of
+ * the number of leafs. Besides the options below, every key of the simulation config is accepted. */
+namespace
+{
+	/* 1, 2, 4, ... up to and including the hardware thread count. */
+	std::string default_threads()
+	{
+		const size_t hardware_threads = std::max(std::thread::hardware_concurrency(), 1u);
+		std::string list;
+		for (size_t n = 1; n < hardware_threads; n *= 2)
+		{
+			list += std::to_string(n) + ",";
+		}
+		return list + std::to_string(hardware_threads);
+	}
+
+	struct run_result
+	{
+		double steps_per_s = 0;
+		simulation::step_stats stats;
+	};
+
+	run_result run(config cfg, const size_t &num_particles, const size_t &num_threads, const size_t &warmup_steps, const size_t &steps)
+	{
+		cfg.num_particles = num_particles;
+		cfg.sim.num_threads = num_threads;
+
+		simulation sim(cfg.sim);
+		sim.add_bulk(generate_scene(cfg));
+		sim.step(warmup_steps);
+
+		const simulation::step_timings timings = sim.step(steps);
+
+		run_result result;
+		result.steps_per_s = timings.steps / timings.total;
+		result.stats = simulation::average_step_stats(sim.get_step_stats(steps));
+		return result;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		std::string out = "particles_scaling.csv";
+		std::string mode = "strong";
+		std::string particles = "10000,100000,1000000";
+		std::string threads = default_threads();
+		std::string steps = "20";
+		std::string warmup_steps = "2";
+
+		std::vector<const char *> args(argv, argv + argc);
+		config::extract_options(args, {{"out", &out}, {"mode", &mode}, {"particles", &particles}, {"threads", &threads},
+		                               {"steps", &steps}, {"warmup_steps", &warmup_steps}});
+
+		config cfg;
+		cfg.seed = config::default_seed;
+		cfg.load(static_cast<int>(args.size()), args.data());
+		if (cfg.help)
+		{
+			std::printf("Usage: %s [--out=<csv>] [--mode=strong|weak] [--particles=<n,...>] [--threads=<n,...>] [--steps=<n>]\n"
+			            "       [--warmup_steps=<n>] [config options]\n\n"
+			            "--particles is the particle count of each run in strong mode, and per thread in weak mode.\n\n", argv[0]);
+			config::print_usage(argv[0]);
+			return 0;
+		}
+
+		ASSERT_EX_M_PRINTF(mode == "strong" || mode == "weak", "Unknown mode '%s', expected strong or weak", mode.c_str());
+		const bool weak = mode == "weak";
+		const std::vector<size_t> particle_counts = config::parse_list<size_t>("particles", particles);
+		std::vector<size_t> thread_counts = config::parse_list<size_t>("threads", threads);
+		std::sort(thread_counts.begin(), thread_counts.end());
+		ASSERT_EX_M(thread_counts.front() > 0, "Thread counts must be positive");
+		const size_t num_steps = std::max<size_t>(std::stoull(steps), 1);
+		const size_t num_warmup_steps = std::stoull(warmup_steps);
+
+		std::string csv = "mode,num_particles,num_threads,steps,steps_per_s,speedup,efficiency,ms_per_step,serial_ms,parallel_ms,"
+		                  "serial_fraction,worker_spin,num_leafs,pair_interactions,cell_interactions\n";
+		for (const size_t &base_particles : particle_counts)
+		{
+			double base_rate = 0;
+			for (const size_t &num_threads : thread_counts)
+			{
+				const size_t num_particles = weak ? base_particles * num_threads : base_particles;
+				const run_result r = run(cfg, num_particles, num_threads, num_warmup_steps, num_steps);
+				const simulation::step_stats &s = r.stats;
+
+				if (base_rate == 0)
+				{
+					base_rate = r.steps_per_s;
+				}
+				/* Strong: ideal speedup is proportional to the threads. Weak: ideal is a constant rate. */
+				const double speedup = r.steps_per_s / base_rate * (weak ? static_cast<double>(num_threads) / thread_counts.front() : 1.);
+				const double efficiency = speedup / (static_cast<double>(num_threads) / thread_counts.front());
+
+				const double serial = s.phases[simulation::phase_find_leafs] + s.phases[simulation::phase_propagate_up] +
+				                      s.phases[simulation::phase_propagate_down] + s.phases[simulation::phase_snapshot];
+				const double parallel = s.phases[simulation::phase_center_of_mass] + s.phases[simulation::phase_interactions] +
+				                        s.phases[simulation::phase_integration];
+				double busy = 0;
+				double spin = 0;
+				for (const simulation::worker_stats &w : s.workers)
+				{
+					busy += w.busy;
+					spin += w.spin;
+				}
+				const double spin_fraction = spin / std::max(busy + spin, 1e-12);
+
+				INFO("%s, %zu particles, %zu threads: %.3f steps/s, efficiency %.1f%%, serial %.1f%%, worker spin %.1f%%", mode.c_str(),
+				     num_particles, num_threads, r.steps_per_s, efficiency * 100, serial / s.total * 100, spin_fraction * 100);
+
+				char line[512];
+				std::snprintf(line, sizeof(line), "%s,%zu,%zu,%zu,%.6f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%zu,%llu,%llu\n", mode.c_str(),
+				              num_particles, num_threads, num_steps, r.steps_per_s, speedup, efficiency, s.total * 1000, serial * 1000,
+				              parallel * 1000, serial / s.total, spin_fraction, s.num_leafs,
+				              static_cast<unsigned long long>(s.particle_interactions), static_cast<unsigned long long>(s.cell_interactions));
+				csv += line;
+			}
+		}
+
+		output_file file(out, false);
+		file.write(csv.data(), csv.size());
+		file.close();
+		INFO("Results written to '%s'", out.c_str());
+	}
+	catch(const std::exception &ex)
+	{
+		ERROR("%s", ex.what());
+		return -1;
+	}
+
+	return 0;
+}
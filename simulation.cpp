@@ -1,7 +1,64 @@
+#include <chrono>
 #include <thread>
 #include <cmath>
 
 #include "simulation.hpp"
+#include "helper.hpp"
+#include "parallel.hpp"
+#include "tracer.hpp"
+
+static void atomic_max(std::atomic<double> &value, const double &candidate)
+{
+	double current = value.load();
+	while (current < candidate && !value.compare_exchange_weak(current, candidate))
+	{
+	}
+}
+
+/* The calling thread's hardware counters, null if disabled or unavailable. */
+static const perf_counters *thread_perf_counters(const bool &enabled)
+{
+	if (!enabled)
+	{
+		return nullptr;
+	}
+	const perf_counters &counters = perf_counters::this_thread();
+	return counters.is_available() ? &counters : nullptr;
+}
+
+/* Splits hardware counts between consecutive samples into phases. Does nothing without counters. */
+class counter_sampler
+{
+	const perf_counters *const m_counters;
+	perf_counters::values m_last = {};
+
+public:
+	counter_sampler(const perf_counters *counters) : m_counters(counters)
+	{
+		if (m_counters != nullptr)
+		{
+			m_last = m_counters->read();
+		}
+	}
+
+	/* Adds the counts since the last sample to into, or drops them if into is null. */
+	void sample(perf_counters::values *into)
+	{
+		if (m_counters == nullptr)
+		{
+			return;
+		}
+		const perf_counters::values now = m_counters->read();
+		if (into != nullptr)
+		{
+			for (size_t i = 0; i < perf_counters::num_counters; ++i)
+			{
+				(*into)[i] += now[i] - m_last[i];
+			}
+		}
+		m_last = now;
+	}
+};
 
 simulation::cell::cell(cell *const parent, const cube<double> &c, const size_t &particles_limit) : m_parent(parent), m_cube(c), m_particles_limit(particles_limit)
 {
@@ -9,10 +66,8 @@ simulation::cell::cell(cell *const parent, const cube<double> &c, const size_t &
 	m_children.reserve(8);
 }
 
-void simulation::cell::subdivide()
+void simulation::cell::create_children()
 {
-	assert(m_children.empty());
-
 	const double half_size = m_cube.half_size * 0.5;
 	m_children.emplace_back(this, cube<double>{m_cube.pos + vec3<double>{-half_size, -half_size, -half_size}, half_size}, m_particles_limit);
 	m_children.emplace_back(this, cube<double>{m_cube.pos + vec3<double>{-half_size, -half_size, half_size}, half_size}, m_particles_limit);
@@ -22,6 +77,13 @@ void simulation::cell::subdivide()
 	m_children.emplace_back(this, cube<double>{m_cube.pos + vec3<double>{half_size, -half_size, half_size}, half_size}, m_particles_limit);
 	m_children.emplace_back(this, cube<double>{m_cube.pos + vec3<double>{half_size, half_size, -half_size}, half_size}, m_particles_limit);
 	m_children.emplace_back(this, cube<double>{m_cube.pos + vec3<double>{half_size, half_size, half_size}, half_size}, m_particles_limit);
+}
+
+void simulation::cell::subdivide()
+{
+	assert(m_children.empty());
+
+	create_children();
 
 	m_num_particles = 0;
 	for (const particle &p : m_particles)
@@ -169,27 +231,6 @@ void simulation::cell::get_particles(std::vector<particle> &particles) const
 	}
 }
 
-void simulation::cell::get_particles_positions(std::vector<vec3<double>> &particles) const
-{
-	if (!m_children.empty())
-	{
-		for (const cell &child : m_children)
-		{
-			child.get_particles_positions(particles);
-		}
-	}
-	else
-	{
-		size_t it = particles.size();
-		particles.resize(particles.size() + m_particles.size());
-		for (const particle &p : m_particles)
-		{
-			particles[it] = p.pos;
-			++it;
-		}
-	}
-}
-
 void simulation::cell::calculate_center_of_mass()
 {
 	m_center_of_mass = {};
@@ -200,26 +241,52 @@ void simulation::cell::calculate_center_of_mass()
 	m_center_of_mass = m_center_of_mass / m_num_particles;
 }
 
-simulation::simulation(const double &size, const size_t &num_threads, const double &dt, const double &particle_size,
-                       const double &g_const, const double &wall_collision_cor, const double &collision_max_force,
-                       const double &drag_factor, const size_t &cell_particles_limit, const double &cell_proximity_factor) :
-	m_root(nullptr, cube<double>{{}, size / 2}, cell_particles_limit),
-	m_workers(num_threads),
-	m_barrier(num_threads, [this] {
+simulation::simulation(const parameters &params) :
+	m_root(nullptr, cube<double>{{}, params.size / 2}, params.cell_particles_limit),
+	m_workers(resolve_num_threads(params.num_threads)),
+	m_barrier(m_workers.size(), [this] {
 		reset_leafs_iterator();
+		m_phase_marks[m_num_phase_marks++] = std::chrono::steady_clock::now();
 	}),
-	m_barrier_start(num_threads + 1, [this] {
+	m_barrier_start(m_workers.size() + 1, [this] {
 		reset_leafs_iterator();
 		stop_workers();
+		m_phase_marks[m_num_phase_marks++] = std::chrono::steady_clock::now();
 	}),
-	m_dt(dt),
-	m_particle_size(particle_size),
-	m_g_const(g_const),
-	m_wall_collision_cor(wall_collision_cor),
-	m_collision_max_force(collision_max_force),
-	m_drag_factor(drag_factor),
-	m_cell_proximity_factor(cell_proximity_factor)
+	m_dt(params.dt),
+	m_particle_size(params.particle_size),
+	m_g_const(params.g_const),
+	m_wall_collision_cor(params.wall_collision_cor),
+	m_collision_max_force(params.collision_max_force),
+	m_drag_factor(params.drag_factor),
+	m_cell_proximity_factor(params.cell_proximity_factor),
+	m_timestep_control(params.timestep),
+	m_timestep_control_tmp(params.timestep),
+	m_far_field_interval(std::max<size_t>(params.far_field_interval, 1)),
+	m_far_field_interval_tmp(m_far_field_interval)
+{
+	m_time_tmp.dt = m_dt;
+	m_worker_counters.resize(m_workers.size());
+	m_stats.resize(stats_history);
+	for (step_stats &stats : m_stats)
+	{
+		stats.workers.resize(m_workers.size());
+	}
+}
+
+void simulation::validate_parameters(const parameters &params)
 {
+	ASSERT_EX_M_PRINTF(params.size > 0, "Invalid size %g, expected a positive value", params.size);
+	ASSERT_EX_M_PRINTF(params.dt > 0, "Invalid dt %g, expected a positive value", params.dt);
+	ASSERT_EX_M_PRINTF(params.particle_size > 0, "Invalid particle_size %g, expected a positive value", params.particle_size);
+	/* A leaf must hold at least one particle, otherwise adding one subdivides without end. */
+	ASSERT_EX_M(params.cell_particles_limit > 0, "Invalid cell_particles_limit 0, expected a positive value");
+	if (params.timestep.enabled)
+	{
+		ASSERT_EX_M_PRINTF(params.timestep.dt_min > 0 && params.timestep.dt_min <= params.timestep.dt_max,
+		                   "Invalid adaptive timestep bounds dt_min %g and dt_max %g, expected 0 < dt_min <= dt_max",
+		                   params.timestep.dt_min, params.timestep.dt_max);
+	}
 }
 
 simulation::~simulation()
@@ -227,16 +294,25 @@ simulation::~simulation()
 	stop();
 }
 
+size_t simulation::resolve_num_threads(const size_t &num_threads)
+{
+	if (num_threads > 0)
+	{
+		return num_threads;
+	}
+	return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
 void simulation::spawn_worker_threads()
 {
 	if (!m_workers_alive)
 	{
 		m_workers_alive = true;
 
-		for (auto &worker : m_workers)
+		for (size_t i = 0; i < m_workers.size(); ++i)
 		{
-			worker = std::thread([this]
-								 { calculate_physics(); });
+			m_workers[i] = std::thread([this, i]
+									   { calculate_physics(i); });
 		}
 	}
 }
@@ -276,53 +352,461 @@ const std::vector<vec3<double>> &simulation::get_particles_positions() const
 	return m_particles_positions[0];
 }
 
-void simulation::progress()
+const simulation::render_snapshot &simulation::get_render_snapshot(uint64_t &generation) const
 {
-	std::unique_lock lock{m_head_workers_mutex};
-	double dt = 0;
-	size_t num = 0;
-	while (m_head_alive)
+	std::lock_guard lock(m_user_access_mutex);
+	if (m_swap_render_buffers)
+	{
+		std::swap(m_render_snapshots[0], m_render_snapshots[1]);
+		m_swap_render_buffers = false;
+	}
+	generation = m_render_generation;
+	return m_render_snapshots[0];
+}
+
+/* Leafs get their center of mass and mean velocity from the workers, internal nodes the mean of their children's. */
+static void accumulate_render_nodes(std::vector<simulation::render_node> &nodes, const uint32_t &index)
+{
+	simulation::render_node &node = nodes[index];
+	if (node.next == index + 1 || node.num_particles == 0)
+	{
+		return;
+	}
+
+	vec3<float> sum = {};
+	vec3<float> sum_v = {};
+	for (uint32_t child = index + 1; child < node.next; child = nodes[child].next)
+	{
+		accumulate_render_nodes(nodes, child);
+		sum = sum + nodes[child].center_of_mass * static_cast<float>(nodes[child].num_particles);
+		sum_v = sum_v + nodes[child].mean_velocity * static_cast<float>(nodes[child].num_particles);
+	}
+	node.center_of_mass = sum / static_cast<float>(node.num_particles);
+	node.mean_velocity = sum_v / static_cast<float>(node.num_particles);
+}
+
+void simulation::advance(std::unique_lock<std::shared_mutex> &lock, step_timings &timings)
+{
+	using clock = std::chrono::steady_clock;
+	const auto t1 = clock::now();
+
+	m_export_render = m_render_snapshot_enabled;
+
+	step_stats stats;
+	for (worker_counters &counters : m_worker_counters)
+	{
+		counters = {};
+	}
+	counter_sampler sampler(thread_perf_counters(m_perf_counters_enabled));
+
+	/* Taken before the workers run, so a controller set before the first step already applies to it. */
+	{
+		std::lock_guard lock(m_user_access_mutex);
+		m_timestep_control = m_timestep_control_tmp;
+	}
+
+	m_far_field_step = m_far_field_countdown == 0;
+	if (m_far_field_step)
+	{
+		begin_far_field_interval();
+	}
+	--m_far_field_countdown;
+
+	const double step_dt = m_dt;
+
+	for (const double &weight : integrator::substeps)
 	{
-		const auto t1 = std::chrono::steady_clock::now();
+		m_substep_dt = step_dt * weight;
 
+		const auto t_find = clock::now();
+		sampler.sample(nullptr);
 		m_leafs.clear();
 		m_root.find_leafs(m_leafs);
 
+		/* Workers write the positions of the last substep at each leaf's offset while integrating. */
+		m_export_positions = &weight == &integrator::substeps.back();
+		if (m_export_positions)
+		{
+			m_leaf_offsets.resize(m_leafs.size());
+			size_t offset = 0;
+			for (size_t i = 0; i < m_leafs.size(); ++i)
+			{
+				m_leaf_offsets[i] = offset;
+				offset += m_leafs[i]->m_particles.size();
+			}
+			m_particles_positions[2].resize(offset);
+
+			if (m_export_render)
+			{
+				render_snapshot &snapshot = m_render_snapshots[2];
+				snapshot.vertices.resize(offset);
+				snapshot.nodes.clear();
+				m_leaf_nodes.clear();
+				m_root.flatten(snapshot.nodes, m_leaf_nodes);
+			}
+		}
+
+		const auto t_physics = clock::now();
+		sampler.sample(&stats.counters[phase_find_leafs]);
+		m_num_phase_marks = 0;
 		m_workers_awake = true;
 		lock.unlock();
 		m_head_workers_cv.notify_all();
 		m_barrier_start.wait();
 		lock.lock();
 
+		/* With r-RESPA the far field is one impulse per interval, given on the first substep. Without
+		 * it, every substep needs the full force. */
+		if (m_far_field_interval > 1)
+		{
+			m_far_field_step = false;
+		}
+		m_far_field_kick = 0;
+		m_prev_substep_dt = m_substep_dt;
+
+		const auto t_tree = clock::now();
+		sampler.sample(nullptr);
 		m_root.propagate_particles_up(m_temp_particles);
+		const auto t_down = clock::now();
+		sampler.sample(&stats.counters[phase_propagate_up]);
 		m_root.propagate_particles_down();
 
-		m_particles_positions[2].clear();
-		m_particles_positions[2].reserve(m_root.m_num_particles);
-		m_root.get_particles_positions(m_particles_positions[2]);
+		const auto t_end = clock::now();
+		sampler.sample(&stats.counters[phase_propagate_down]);
+		timings.find_leafs += std::chrono::duration<double>(t_physics - t_find).count();
+		timings.physics += std::chrono::duration<double>(t_tree - t_physics).count();
+		timings.tree_update += std::chrono::duration<double>(t_end - t_tree).count();
+
+		/* Marks: all workers started, center of mass done, interactions done. */
+		stats.num_leafs = m_leafs.size();
+		stats.phases[phase_find_leafs] += std::chrono::duration<double>(t_physics - t_find).count();
+		stats.phases[phase_center_of_mass] += std::chrono::duration<double>(m_phase_marks[1] - t_physics).count();
+		stats.phases[phase_interactions] += std::chrono::duration<double>(m_phase_marks[2] - m_phase_marks[1]).count();
+		stats.phases[phase_integration] += std::chrono::duration<double>(t_tree - m_phase_marks[2]).count();
+		stats.phases[phase_propagate_up] += std::chrono::duration<double>(t_down - t_tree).count();
+		stats.phases[phase_propagate_down] += std::chrono::duration<double>(t_end - t_down).count();
+
+		/* Workers that finished early spin until the last one is done. */
+		clock::time_point last_end = m_phase_marks[2];
+		for (const worker_counters &counters : m_worker_counters)
+		{
+			last_end = std::max(last_end, counters.end);
+		}
+		for (worker_counters &counters : m_worker_counters)
+		{
+			const double spin = std::chrono::duration<double>(last_end - counters.end).count();
+			counters.stats.spin += spin;
+			counters.stats.barrier_spin[wait_integration] += spin;
+		}
 
+		if (tracer::is_enabled())
 		{
-			std::lock_guard lock(m_user_access_mutex);
+			tracer::record("find_leafs", t_find, t_physics, "leafs", m_leafs.size());
+			tracer::record("workers", t_physics, t_tree);
+			tracer::record("propagate_up", t_tree, t_down);
+			tracer::record("propagate_down", t_down, t_end);
+		}
+	}
+
+	m_sim_time += step_dt;
+	++m_step;
+	if (m_far_field_interval > 1)
+	{
+		m_far_field_elapsed += step_dt;
+	}
+
+	/* The impulse of a far field evaluation assumes dt stays fixed until the next one. */
+	if (m_timestep_control.enabled && m_far_field_countdown == 0)
+	{
+		update_timestep();
+	}
 
+	const auto t_snapshot = clock::now();
+	sampler.sample(nullptr);
+	if (m_export_render)
+	{
+		accumulate_render_nodes(m_render_snapshots[2].nodes, 0);
+	}
+	bool positions_taken = false;
+	if (m_snapshot_callback && m_step % m_snapshot_interval == 0)
+	{
+		positions_taken = m_snapshot_callback(m_particles_positions[2], m_step, m_sim_time);
+	}
+
+	{
+		std::lock_guard lock(m_user_access_mutex);
+
+		if (!positions_taken)
+		{
 			m_particles_positions[2].swap(m_particles_positions[1]);
 			m_swap_buffers = true;
+		}
+		if (m_export_render)
+		{
+			m_render_snapshots[2].sim_time = m_sim_time;
+			std::swap(m_render_snapshots[2], m_render_snapshots[1]);
+			m_swap_render_buffers = true;
+			++m_render_generation;
+		}
+
+		m_user_pointer = m_user_pointer_tmp;
+		m_time_tmp.dt = m_dt;
+		m_time_tmp.sim_time = m_sim_time;
+	}
+
+	const auto t2 = clock::now();
+	sampler.sample(&stats.counters[phase_snapshot]);
+	timings.snapshot += std::chrono::duration<double>(t2 - t_snapshot).count();
+	timings.total += std::chrono::duration<double>(t2 - t1).count();
+	timings.sim_time += step_dt;
+	++timings.steps;
+
+	if (tracer::is_enabled())
+	{
+		tracer::record("snapshot", t_snapshot, t2);
+		tracer::record("step", t1, t2, "step", m_step);
+	}
+
+	stats.step = m_step;
+	stats.dt = step_dt;
+	stats.phases[phase_snapshot] = std::chrono::duration<double>(t2 - t_snapshot).count();
+	stats.total = std::chrono::duration<double>(t2 - t1).count();
+	{
+		std::lock_guard lock(m_user_access_mutex);
 
-			m_user_pointer = m_user_pointer_tmp;
+		step_stats &entry = m_stats[m_stats_next];
+		std::swap(stats.workers, entry.workers);
+		entry = std::move(stats);
+		for (size_t i = 0; i < m_worker_counters.size(); ++i)
+		{
+			const worker_counters &counters = m_worker_counters[i];
+			entry.workers[i] = counters.stats;
+			entry.particle_interactions += counters.particle_interactions;
+			entry.cell_interactions += counters.cell_interactions;
+			for (size_t phase = 0; phase < num_phases; ++phase)
+			{
+				for (size_t j = 0; j < perf_counters::num_counters; ++j)
+				{
+					entry.counters[phase][j] += counters.counters[phase][j];
+				}
+			}
 		}
+		m_stats_next = (m_stats_next + 1) % m_stats.size();
+		m_stats_count = std::min(m_stats_count + 1, m_stats.size());
+	}
+}
 
-		const auto t2 = std::chrono::steady_clock::now();
-		dt += std::chrono::duration<double>(t2-t1).count();
-		++num;
+void simulation::progress()
+{
+	tracer::set_thread_name("head");
 
-		if(dt > 1)
+	std::unique_lock lock{m_head_workers_mutex};
+	step_timings timings;
+	while (m_head_alive)
+	{
+		advance(lock, timings);
+
+		const double log_interval = m_stats_log_interval;
+		if (log_interval > 0 && timings.total > log_interval)
+		{
+			const step_stats average = average_step_stats(get_step_stats(timings.steps));
+			INFO("steps/s: %f, sim time/s: %f, dt: %f, %s", timings.steps / timings.total, timings.sim_time / timings.total, m_dt,
+			     format_step_stats(average).c_str());
+			timings = {};
+		}
+		else if (log_interval <= 0)
 		{
-			printf("FPS: %f\n", num / dt);
-			num = 0;
-			dt = 0;
+			timings = {};
 		}
 	}
 }
 
+std::vector<simulation::step_stats> simulation::get_step_stats(const size_t &max_steps) const
+{
+	std::lock_guard lock(m_user_access_mutex);
+
+	const size_t num = std::min(max_steps, m_stats_count);
+	std::vector<step_stats> stats;
+	stats.reserve(num);
+	for (size_t i = 0; i < num; ++i)
+	{
+		stats.push_back(m_stats[(m_stats_next + m_stats.size() - num + i) % m_stats.size()]);
+	}
+	return stats;
+}
+
+simulation::step_stats simulation::average_step_stats(const std::vector<step_stats> &stats)
+{
+	step_stats average;
+	if (stats.empty())
+	{
+		return average;
+	}
+
+	double particle_interactions = 0;
+	double cell_interactions = 0;
+	double num_leafs = 0;
+	std::array<std::array<double, perf_counters::num_counters>, num_phases> counters = {};
+	average.workers.resize(stats.back().workers.size());
+	for (const step_stats &s : stats)
+	{
+		average.dt += s.dt;
+		average.total += s.total;
+		num_leafs += s.num_leafs;
+		particle_interactions += s.particle_interactions;
+		cell_interactions += s.cell_interactions;
+		for (size_t i = 0; i < num_phases; ++i)
+		{
+			average.phases[i] += s.phases[i];
+			for (size_t j = 0; j < perf_counters::num_counters; ++j)
+			{
+				counters[i][j] += s.counters[i][j];
+			}
+		}
+		for (size_t i = 0; i < std::min(s.workers.size(), average.workers.size()); ++i)
+		{
+			average.workers[i].busy += s.workers[i].busy;
+			average.workers[i].spin += s.workers[i].spin;
+			for (size_t j = 0; j < num_barrier_waits; ++j)
+			{
+				average.workers[i].barrier_spin[j] += s.workers[i].barrier_spin[j];
+			}
+		}
+	}
+
+	const double n = stats.size();
+	average.step = stats.back().step;
+	average.dt /= n;
+	average.total /= n;
+	average.num_leafs = static_cast<size_t>(num_leafs / n + 0.5);
+	average.particle_interactions = static_cast<uint64_t>(particle_interactions / n + 0.5);
+	average.cell_interactions = static_cast<uint64_t>(cell_interactions / n + 0.5);
+	for (size_t i = 0; i < num_phases; ++i)
+	{
+		average.phases[i] /= n;
+		for (size_t j = 0; j < perf_counters::num_counters; ++j)
+		{
+			average.counters[i][j] = static_cast<uint64_t>(counters[i][j] / n + 0.5);
+		}
+	}
+	for (worker_stats &worker : average.workers)
+	{
+		worker.busy /= n;
+		worker.spin /= n;
+		for (double &spin : worker.barrier_spin)
+		{
+			spin /= n;
+		}
+	}
+	return average;
+}
+
+std::string simulation::format_step_stats(const step_stats &stats)
+{
+	std::string line = "ms/step:";
+	char buffer[128];
+	for (size_t i = 0; i < num_phases; ++i)
+	{
+		std::snprintf(buffer, sizeof(buffer), " %s %.3f,", phase_names[i], stats.phases[i] * 1000);
+		line += buffer;
+	}
+
+	double busy = 0;
+	double spin = 0;
+	double max_spin = 0;
+	std::array<double, num_barrier_waits> barrier_spin = {};
+	for (const worker_stats &worker : stats.workers)
+	{
+		busy += worker.busy;
+		spin += worker.spin;
+		max_spin = std::max(max_spin, worker.spin / std::max(worker.busy + worker.spin, 1e-12));
+		for (size_t i = 0; i < num_barrier_waits; ++i)
+		{
+			barrier_spin[i] += worker.barrier_spin[i];
+		}
+	}
+	std::snprintf(buffer, sizeof(buffer), " worker spin: %.1f%% (max %.1f%%", spin / std::max(busy + spin, 1e-12) * 100, max_spin * 100);
+	line += buffer;
+	for (size_t i = 0; i < num_barrier_waits; ++i)
+	{
+		std::snprintf(buffer, sizeof(buffer), ", %s %.1f%%", barrier_wait_names[i], barrier_spin[i] / std::max(busy + spin, 1e-12) * 100);
+		line += buffer;
+	}
+	std::snprintf(buffer, sizeof(buffer), "), leafs: %zu, pair interactions: %llu, cell interactions: %llu", stats.num_leafs,
+	              static_cast<unsigned long long>(stats.particle_interactions), static_cast<unsigned long long>(stats.cell_interactions));
+	line += buffer;
+
+	/* Per phase: instructions per cycle, LLC misses and branch misses per thousand instructions. */
+	for (size_t i = 0; i < num_phases; ++i)
+	{
+		const perf_counters::values &c = stats.counters[i];
+		if (c[perf_counters::cycles] == 0 || c[perf_counters::instructions] == 0)
+		{
+			continue;
+		}
+		const double kilo_instructions = c[perf_counters::instructions] * 1e-3;
+		std::snprintf(buffer, sizeof(buffer), ", %s: IPC %.2f, LLC misses/ki %.3f, branch misses/ki %.3f", phase_names[i],
+		              static_cast<double>(c[perf_counters::instructions]) / c[perf_counters::cycles],
+		              c[perf_counters::llc_misses] / kilo_instructions, c[perf_counters::branch_misses] / kilo_instructions);
+		line += buffer;
+	}
+	return line;
+}
+
+simulation::step_timings simulation::step(const size_t &num_steps)
+{
+	ASSERT_EX_M(!m_head_alive, "simulation::step can't be used while the simulation is running");
+
+	spawn_worker_threads();
+	tracer::set_thread_name("head");
+
+	std::unique_lock lock{m_head_workers_mutex};
+	step_timings timings;
+	for (size_t i = 0; i < num_steps; ++i)
+	{
+		advance(lock, timings);
+	}
+	return timings;
+}
+
+simulation::step_timings simulation::run_for(const double &sim_time)
+{
+	ASSERT_EX_M(!m_head_alive, "simulation::run_for can't be used while the simulation is running");
+
+	spawn_worker_threads();
+	tracer::set_thread_name("head");
+
+	std::unique_lock lock{m_head_workers_mutex};
+	step_timings timings;
+	const double end_time = m_sim_time + sim_time;
+	/* Stop at the step boundary nearest to end_time. */
+	while (m_sim_time + m_dt * 0.5 < end_time)
+	{
+		advance(lock, timings);
+	}
+	return timings;
+}
+
+void simulation::begin_far_field_interval()
+{
+	{
+		std::lock_guard lock(m_user_access_mutex);
+		m_far_field_interval = m_far_field_interval_tmp;
+	}
+
+	/* The impulse closes the previous interval with half its far field and opens the next one with
+	 * the other half. Without r-RESPA the far field is part of the accelerations and
+	 * m_far_field_elapsed stays 0; the closing half of the last substep is then still pending in
+	 * the merged leapfrog kick, which pays it itself if the far field stays in the accelerations.
+	 * So changing the interval at runtime applies every dt of far field exactly once. */
+	const double closing = m_far_field_elapsed > 0 ? m_far_field_elapsed * 0.5 : m_prev_substep_dt * 0.5;
+	const double paid_by_kick = m_far_field_interval == 1 ? m_prev_substep_dt * 0.5 : 0;
+	const double opening = m_far_field_interval > 1 ? m_far_field_interval * m_dt * 0.5 : 0;
+	m_far_field_kick = closing - paid_by_kick + opening;
+	m_far_field_elapsed = 0;
+	m_far_field_countdown = m_far_field_interval;
+}
+
 void simulation::start()
 {
 	if(!m_head_alive)
@@ -343,20 +827,382 @@ void simulation::stop()
 		m_head_alive = false;
 
 		m_head.join();
-
-		kill_worker_threads();
 	}
+
+	kill_worker_threads();
 }
 
 void simulation::add(const particle &p)
 {
 	m_root.add(p);
 	m_particles_positions[0].push_back(p.pos);
+	m_render_snapshots[0].vertices.push_back({vec3<float>::type_cast(p.pos), vec3<float>::type_cast(p.v)});
+	m_render_snapshots[0].nodes.clear();
+	++m_render_generation;
+}
+
+void simulation::cell::flatten(std::vector<render_node> &nodes, std::vector<uint32_t> &leaf_nodes) const
+{
+	const uint32_t index = nodes.size();
+	nodes.push_back({cube<float>{vec3<float>::type_cast(m_cube.pos), static_cast<float>(m_cube.half_size)}, {}, {}, static_cast<uint32_t>(m_num_particles)});
+
+	if (!m_children.empty())
+	{
+		for (const cell &child : m_children)
+		{
+			child.flatten(nodes, leaf_nodes);
+		}
+	}
+	else if (m_num_particles > 0)
+	{
+		leaf_nodes.push_back(index);
+	}
+
+	nodes[index].next = nodes.size();
+}
+
+void simulation::cell::build(const particle *particles, const std::pair<uint64_t, size_t> *order, const size_t &num, const uint32_t &depth,
+                             std::vector<build_task> *frontier, const uint32_t &frontier_depth)
+{
+	m_num_particles = num;
+
+	if (num <= m_particles_limit || depth == morton_bits_per_axis)
+	{
+		/* Leafs keep the input order, like add() would, so that a restarted run sums forces in the same order. */
+		std::vector<size_t> indices(num);
+		std::transform(order, order + num, indices.begin(), [](const std::pair<uint64_t, size_t> &o)
+					   { return o.second; });
+		std::sort(indices.begin(), indices.end());
+		for (const size_t &i : indices)
+		{
+			m_particles.push_back(particles[i]);
+		}
+		return;
+	}
+
+	create_children();
+
+	/* The child index is the next 3 bits of the Morton key, so children are contiguous ranges. */
+	const uint32_t shift = 3 * (morton_bits_per_axis - 1 - depth);
+	size_t begin = 0;
+	for (uint64_t i = 0; i < 8; ++i)
+	{
+		const size_t end = std::partition_point(order + begin, order + num, [&](const std::pair<uint64_t, size_t> &o)
+												{ return ((o.first >> shift) & 7) <= i; }) - order;
+
+		cell &child = m_children[i];
+		if (frontier != nullptr && depth + 1 == frontier_depth)
+		{
+			child.m_num_particles = end - begin;
+			frontier->push_back({&child, order + begin, end - begin, depth + 1});
+		}
+		else if (end > begin)
+		{
+			child.build(particles, order + begin, end - begin, depth + 1, frontier, frontier_depth);
+		}
+		begin = end;
+	}
+}
+
+void simulation::add_bulk(std::span<const particle> particles)
+{
+	ASSERT_EX_M(!m_head_alive, "Particles can't be bulk-added while the simulation is running");
+
+	std::vector<particle> merged;
+	if (m_root.m_num_particles > 0)
+	{
+		merged.reserve(m_root.m_num_particles + particles.size());
+		m_root.get_particles(merged);
+		merged.insert(merged.end(), particles.begin(), particles.end());
+		particles = merged;
+	}
+
+	const size_t num = particles.size();
+	const size_t num_threads = std::max<size_t>(m_workers.size(), 1);
+
+	/* Each level of the key is the comparison add() makes against the centre of the cell, with the
+	 * centres computed like create_children() does, so particles within an ulp of a boundary land
+	 * in the same cell. Scaling to a grid instead rounds (x - min) * scale and may disagree there. */
+	/* Multiplying by +-1 is exact and keeps the descent free of branches. */
+	const auto sign = [](const uint64_t &upper)
+	{
+		return static_cast<double>(static_cast<int64_t>(upper * 2) - 1);
+	};
+	const auto morton_key = [&root = m_root.m_cube, &sign](const vec3<double> &pos)
+	{
+		vec3<double> center = root.pos;
+		double half_size = root.half_size;
+		uint64_t key = 0;
+		for (uint32_t level = 0; level < morton_bits_per_axis; ++level)
+		{
+			half_size *= 0.5;
+			const uint64_t x = pos.x > center.x;
+			const uint64_t y = pos.y > center.y;
+			const uint64_t z = pos.z > center.z;
+			key = key << 3 | x << 2 | y << 1 | z;
+			center = center + vec3<double>{sign(x), sign(y), sign(z)} * half_size;
+		}
+		return key;
+	};
+
+	/* Ties are broken by input index, which keeps the result independent of the thread count. */
+	std::vector<std::pair<uint64_t, size_t>> order(num);
+	parallel_for(num_threads, num, [&](const size_t &begin, const size_t &end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			order[i] = {morton_key(particles[i].pos), i};
+		}
+		std::sort(order.begin() + begin, order.begin() + end);
+	});
+
+	/* Pairwise merges of the sorted chunks, each round in parallel. */
+	const size_t chunk = (num + num_threads - 1) / num_threads;
+	for (size_t width = chunk; width < num; width *= 2)
+	{
+		std::vector<std::thread> threads;
+		for (size_t begin = 0; begin + width < num; begin += width * 2)
+		{
+			threads.emplace_back([&order, begin, middle = begin + width, end = std::min(begin + width * 2, num)]
+								 { std::inplace_merge(order.begin() + begin, order.begin() + middle, order.begin() + end); });
+		}
+		for (std::thread &t : threads)
+		{
+			t.join();
+		}
+	}
+
+	m_particles_positions[0].resize(num);
+	m_render_snapshots[0].vertices.resize(num);
+	m_render_snapshots[0].nodes.clear();
+	parallel_for(num_threads, num, [&](const size_t &begin, const size_t &end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			m_particles_positions[0][i] = particles[i].pos;
+			m_render_snapshots[0].vertices[i] = {vec3<float>::type_cast(particles[i].pos), vec3<float>::type_cast(particles[i].v)};
+		}
+	});
+	++m_render_generation;
+
+	m_root.m_children.clear();
+	m_root.m_particles.clear();
+
+	/* Build the top levels serially, then the subtrees below them in parallel. */
+	uint32_t frontier_depth = 1;
+	while ((size_t{1} << (3 * frontier_depth)) < num_threads * 8 && frontier_depth < morton_bits_per_axis)
+	{
+		++frontier_depth;
+	}
+
+	std::vector<build_task> frontier;
+	m_root.build(particles.data(), order.data(), num, 0, &frontier, frontier_depth);
+
+	std::atomic_size_t next_task = 0;
+	parallel_for(num_threads, num_threads, [&](const size_t &, const size_t &)
+	{
+		size_t i;
+		while ((i = next_task++) < frontier.size())
+		{
+			const build_task &t = frontier[i];
+			if (t.num > 0)
+			{
+				t.c->build(particles.data(), t.order, t.num, t.depth, nullptr, 0);
+			}
+		}
+	});
+}
+
+void simulation::cell::for_each_particle_block(const std::function<void(const particle *, const size_t &)> &f) const
+{
+	if (!m_children.empty())
+	{
+		for (const cell &child : m_children)
+		{
+			child.for_each_particle_block(f);
+		}
+	}
+	else if (!m_particles.empty())
+	{
+		f(m_particles.data(), m_particles.size());
+	}
+}
+
+void simulation::for_each_particle_block(const std::function<void(const particle *, const size_t &)> &f) const
+{
+	ASSERT_EX_M(!m_head_alive, "Particles can't be accessed while the simulation is running");
+	m_root.for_each_particle_block(f);
+}
+
+uint64_t simulation::state_hash() const
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	const auto add = [&hash](const void *data, const size_t &size)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			hash = (hash ^ static_cast<const uint8_t *>(data)[i]) * 0x100000001b3;
+		}
+	};
+
+	for_each_particle_block([&](const particle *particles, const size_t &num)
+	{
+		for (size_t i = 0; i < num; ++i)
+		{
+			add(&particles[i].pos, sizeof(vec3<double>));
+			add(&particles[i].v, sizeof(vec3<double>));
+			add(&particles[i].a, sizeof(vec3<double>));
+		}
+	});
+
+	const integration_state state = get_integration_state();
+	add(&state.step, sizeof(state.step));
+	add(&state.sim_time, sizeof(state.sim_time));
+	add(&state.dt, sizeof(state.dt));
+	add(&state.prev_substep_dt, sizeof(state.prev_substep_dt));
+	add(&state.far_field_elapsed, sizeof(state.far_field_elapsed));
+	add(&state.far_field_countdown, sizeof(state.far_field_countdown));
+	return hash;
+}
+
+std::vector<vec3<double>> simulation::tree_accelerations()
+{
+	ASSERT_EX_M(!m_head_alive, "simulation::tree_accelerations can't be used while the simulation is running");
+
+	const bool far_field_step = m_far_field_step;
+	const bool pointer_active = m_user_pointer.active;
+	m_far_field_step = true;
+	m_user_pointer.active = false;
+
+	m_leafs.clear();
+	m_root.find_leafs(m_leafs);
+
+	/* Forces are only written to the leaf being processed, so leafs can be split between threads like in calculate_physics. */
+	parallel_for(m_workers.size(), m_leafs.size(), [this](const size_t &begin, const size_t &end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			m_leafs[i]->calculate_center_of_mass();
+		}
+	});
+	parallel_for(m_workers.size(), m_leafs.size(), [this](const size_t &begin, const size_t &end)
+	{
+		worker_counters counters;
+		for (size_t i = begin; i < end; ++i)
+		{
+			leaf_interactions(i, counters);
+		}
+	});
+
+	std::vector<vec3<double>> accelerations;
+	accelerations.reserve(get_num_particles());
+	for (cell *c : m_leafs)
+	{
+		for (particle &p : c->m_particles)
+		{
+			/* With r-RESPA the far field is left in the leaf for the impulse. */
+			accelerations.push_back(m_far_field_interval == 1 ? p.a : p.a + c->m_a);
+			p.a = {};
+		}
+		c->m_a = {};
+	}
+
+	m_far_field_step = far_field_step;
+	m_user_pointer.active = pointer_active;
+	return accelerations;
+}
+
+std::vector<vec3<double>> simulation::direct_accelerations() const
+{
+	std::vector<particle> particles;
+	particles.reserve(get_num_particles());
+	for_each_particle_block([&particles](const particle *block, const size_t &num)
+	{
+		particles.insert(particles.end(), block, block + num);
+	});
+
+	std::vector<vec3<double>> accelerations(particles.size());
+	parallel_for(m_workers.size(), particles.size(), [&](const size_t &begin, const size_t &end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			vec3<double> a = {};
+			for (size_t j = 0; j < particles.size(); ++j)
+			{
+				if (j != i)
+				{
+					a = a + particle_pair_interaction(particles[i], particles[j]);
+				}
+			}
+			accelerations[i] = a;
+		}
+	});
+	return accelerations;
+}
+
+simulation::parameters simulation::get_parameters() const
+{
+	std::lock_guard lock(m_user_access_mutex);
+
+	parameters params;
+	params.size = get_size();
+	params.num_threads = m_workers.size();
+	params.dt = m_dt;
+	params.particle_size = m_particle_size;
+	params.g_const = m_g_const;
+	params.wall_collision_cor = m_wall_collision_cor;
+	params.collision_max_force = m_collision_max_force;
+	params.drag_factor = m_drag_factor;
+	params.cell_particles_limit = m_root.m_particles_limit;
+	params.cell_proximity_factor = m_cell_proximity_factor;
+	params.timestep = m_timestep_control_tmp;
+	params.far_field_interval = m_far_field_interval_tmp;
+	return params;
+}
+
+void simulation::set_snapshot_callback(const size_t &interval, snapshot_callback callback)
+{
+	ASSERT_EX_M(!m_head_alive, "The snapshot callback can't be changed while the simulation is running");
+
+	m_snapshot_interval = interval;
+	m_snapshot_callback = interval > 0 ? std::move(callback) : nullptr;
+}
+
+simulation::integration_state simulation::get_integration_state() const
+{
+	ASSERT_EX_M(!m_head_alive, "The integration state can't be accessed while the simulation is running");
+
+	integration_state state;
+	state.step = m_step;
+	state.sim_time = m_sim_time;
+	state.dt = m_dt;
+	state.prev_substep_dt = m_prev_substep_dt;
+	state.far_field_elapsed = m_far_field_elapsed;
+	state.far_field_countdown = m_far_field_countdown;
+	return state;
+}
+
+void simulation::set_integration_state(const integration_state &state)
+{
+	ASSERT_EX_M(!m_head_alive, "The integration state can't be changed while the simulation is running");
+
+	m_step = state.step;
+	m_sim_time = state.sim_time;
+	m_dt = state.dt;
+	m_prev_substep_dt = state.prev_substep_dt;
+	m_far_field_elapsed = state.far_field_elapsed;
+	m_far_field_countdown = state.far_field_countdown;
+
+	std::lock_guard lock(m_user_access_mutex);
+	m_time_tmp.dt = m_dt;
+	m_time_tmp.sim_time = m_sim_time;
 }
 
-void simulation::calculate_physics()
+void simulation::calculate_physics(const size_t &worker)
 {
+	using clock = std::chrono::steady_clock;
 	int i;
+	tracer::set_thread_name("worker " + std::to_string(worker));
 	std::shared_lock lock(m_head_workers_mutex);
 	while (true)
 	{
@@ -367,7 +1213,55 @@ void simulation::calculate_physics()
 			return;
 		}
 
+		worker_counters &counters = m_worker_counters[worker];
+		auto t = clock::now();
+		size_t leafs = 0;
+		const bool tracing = tracer::is_enabled();
+		auto batch_begin = t;
+		size_t batch_leafs = 0;
+		counter_sampler sampler(thread_perf_counters(m_perf_counters_enabled));
+		/* Counts a processed leaf, and traces every trace_batch_leafs of them as a batch within the phase. */
+		const auto leaf_done = [&]
+		{
+			++leafs;
+			if (tracing && ++batch_leafs == trace_batch_leafs)
+			{
+				const auto now = clock::now();
+				tracer::record("leaf_batch", batch_begin, now, "leafs", batch_leafs);
+				batch_begin = now;
+				batch_leafs = 0;
+			}
+		};
+		/* Adds the time since the last lap to busy or spin, and the hardware counts to the phase unless
+		 * it is num_phases, and traces it with the leafs processed and its last, partial batch. */
+		const auto lap = [&](double &into, const char *name, const phase &p)
+		{
+			const auto now = clock::now();
+			into += std::chrono::duration<double>(now - t).count();
+			sampler.sample(p < num_phases ? &counters.counters[p] : nullptr);
+			if (tracing)
+			{
+				if (batch_leafs > 0)
+				{
+					tracer::record("leaf_batch", batch_begin, now, "leafs", batch_leafs);
+				}
+				tracer::record(name, t, now, leafs > 0 ? "leafs" : nullptr, leafs);
+			}
+			t = now;
+			batch_begin = now;
+			leafs = 0;
+			batch_leafs = 0;
+		};
+		/* A lap spent spinning at barrier b. */
+		const auto wait_lap = [&](const barrier_wait &b)
+		{
+			const double spin = counters.stats.spin;
+			lap(counters.stats.spin, "barrier", num_phases);
+			counters.stats.barrier_spin[b] += counters.stats.spin - spin;
+		};
+
 		m_barrier_start.wait();
+		wait_lap(wait_start);
 
 		const size_t num = m_leafs.size();
 
@@ -375,69 +1269,216 @@ void simulation::calculate_physics()
 		{
 			cell &c = *m_leafs[i];
 			c.calculate_center_of_mass();
+			leaf_done();
 		}
 
+		lap(counters.stats.busy, "center_of_mass", phase_center_of_mass);
 		m_barrier.wait();
+		wait_lap(wait_center_of_mass);
+
+		while ((i = m_leafs_iterator++) < num)
+		{
+			leaf_interactions(i, counters);
+			leaf_done();
+		}
+
+		lap(counters.stats.busy, "interactions", phase_interactions);
+		m_barrier.wait();
+		wait_lap(wait_interactions);
+
+		double max_a2 = 0;
+		double max_dv2 = 0;
+		const bool far_field_step = m_far_field_step;
 
 		while ((i = m_leafs_iterator++) < num)
 		{
 			cell &c1 = *m_leafs[i];
 
-			for (size_t j = 0; j < num; j++)
+			/* Zero without r-RESPA, except when the interval was just lowered to 1. */
+			vec3<double> impulse = {};
+			if (far_field_step)
+			{
+				impulse = c1.m_a * m_far_field_kick;
+				c1.m_a = {};
+			}
+
+			for (particle &p1 : c1.m_particles)
 			{
-				if (j == i)
+				p1.v = p1.v + impulse;
+
+				if (m_timestep_control.enabled)
 				{
-					continue;
+					max_a2 = std::max(max_a2, p1.a * p1.a);
 				}
 
-				const cell &c2 = *m_leafs[j];
-				cell_pair_interaction(c1, c2);
+				integrator::advance(p1.pos, p1.v, p1.a, m_prev_substep_dt, m_substep_dt);
+
+				spherical_wall(p1);
+
+				p1.a = {};
 			}
 
-			for (size_t k = 0; k < c1.m_num_particles; k++)
+			if (m_export_positions)
 			{
-				particle &p1 = c1.m_particles[k];
-				for (size_t l = k + 1; l < c1.m_num_particles; l++)
+				vec3<double> *positions = m_particles_positions[2].data() + m_leaf_offsets[i];
+				for (const particle &p1 : c1.m_particles)
 				{
-					particle &p2 = c1.m_particles[l];
-					particle_pair_interaction_local(p1, p2);
+					*positions++ = p1.pos;
 				}
+			}
 
-				for (const cell *const c : c1.m_surrounding_cells)
+			if (m_export_positions && m_export_render)
+			{
+				render_snapshot &snapshot = m_render_snapshots[2];
+				render_node &node = snapshot.nodes[m_leaf_nodes[i]];
+				export_render_leaf(c1.m_particles, snapshot.vertices.data() + m_leaf_offsets[i], node);
+				node.first = m_leaf_offsets[i];
+			}
+
+			if (m_timestep_control.enabled)
+			{
+				/* Velocities relative to the leaf's mean velocity bound the closing speed of neighbours. */
+				vec3<double> mean_v = {};
+				for (const particle &p1 : c1.m_particles)
 				{
-					const cell &c2 = *c;
-					for (const particle &p2 : c2.m_particles)
-					{
-						particle_pair_interaction_global(p1, p2);
-					}
+					mean_v = mean_v + p1.v;
 				}
+				mean_v = mean_v / c1.m_particles.size();
 
-				p1.a = p1.a + c1.m_a;
-
-				if(m_user_pointer.active)
+				for (const particle &p1 : c1.m_particles)
 				{
-					user_pointer_force(p1);
+					const vec3<double> dv = p1.v - mean_v;
+					max_dv2 = std::max(max_dv2, dv * dv);
 				}
 			}
-			c1.m_surrounding_cells.clear();
-			c1.m_a = {};
+
+			leaf_done();
 		}
 
-		m_barrier.wait();
+		if (m_timestep_control.enabled)
+		{
+			atomic_max(m_max_acceleration_squared, max_a2);
+			atomic_max(m_max_relative_velocity_squared, max_dv2);
+		}
 
-		while ((i = m_leafs_iterator++) < num)
+		lap(counters.stats.busy, "integration", phase_integration);
+		counters.end = t;
+	}
+}
+
+void simulation::leaf_interactions(const size_t &i, worker_counters &counters)
+{
+	const size_t num = m_leafs.size();
+	cell &c1 = *m_leafs[i];
+
+	if (m_far_field_step)
+	{
+		for (size_t j = 0; j < num; j++)
 		{
-			cell &c1 = *m_leafs[i];
-			for (particle &p1 : c1.m_particles)
+			if (j == i)
 			{
-				p1.pos = p1.pos + p1.v * m_dt + p1.a * m_dt * m_dt * 0.5;
-				p1.v = p1.v + p1.a * m_dt;
+				continue;
+			}
 
-				spherical_wall(p1);
+			const cell &c2 = *m_leafs[j];
+			cell_pair_interaction(c1, c2);
+		}
+	}
+	else
+	{
+		for (size_t j = 0; j < num; j++)
+		{
+			const cell &c2 = *m_leafs[j];
+			if (j != i && cells_are_close(c1, c2))
+			{
+				c1.m_surrounding_cells.push_back(&c2);
+			}
+		}
+	}
 
-				p1.a = {};
+	size_t surrounding_particles = 0;
+	for (const cell *const c : c1.m_surrounding_cells)
+	{
+		surrounding_particles += c->m_particles.size();
+	}
+	counters.particle_interactions += c1.m_num_particles * (c1.m_num_particles - 1) / 2 + c1.m_num_particles * surrounding_particles;
+	if (m_far_field_step)
+	{
+		counters.cell_interactions += num - 1 - c1.m_surrounding_cells.size();
+	}
+
+	for (size_t k = 0; k < c1.m_num_particles; k++)
+	{
+		particle &p1 = c1.m_particles[k];
+		for (size_t l = k + 1; l < c1.m_num_particles; l++)
+		{
+			particle &p2 = c1.m_particles[l];
+			particle_pair_interaction_local(p1, p2);
+		}
+
+		for (const cell *const c : c1.m_surrounding_cells)
+		{
+			const cell &c2 = *c;
+			for (const particle &p2 : c2.m_particles)
+			{
+				particle_pair_interaction_global(p1, p2);
 			}
 		}
+
+		if (m_far_field_interval == 1)
+		{
+			p1.a = p1.a + c1.m_a;
+		}
+
+		if(m_user_pointer.active)
+		{
+			user_pointer_force(p1);
+		}
+	}
+	c1.m_surrounding_cells.clear();
+}
+
+void simulation::export_render_leaf(const std::vector<particle> &particles, render_vertex *vertices, render_node &node)
+{
+	vec3<float> sum = {};
+	vec3<float> sum_v = {};
+	for (const particle &p : particles)
+	{
+		const render_vertex vertex = {vec3<float>::type_cast(p.pos), vec3<float>::type_cast(p.v)};
+		*vertices++ = vertex;
+		sum = sum + vertex.pos;
+		sum_v = sum_v + vertex.v;
+	}
+
+	node.center_of_mass = sum / static_cast<float>(particles.size());
+	node.mean_velocity = sum_v / static_cast<float>(particles.size());
+}
+
+void simulation::update_timestep()
+{
+	const timestep_control &tc = m_timestep_control;
+	const double max_a = sqrt(m_max_acceleration_squared.exchange(0));
+	/* Two particles may approach each other from opposite sides of the mean. */
+	const double max_relative_v = 2 * sqrt(m_max_relative_velocity_squared.exchange(0));
+
+	double target = tc.dt_max;
+	if (max_a > 0)
+	{
+		target = std::min(target, tc.accel_factor * sqrt(m_particle_size / max_a));
+	}
+	if (max_relative_v > 0)
+	{
+		target = std::min(target, tc.velocity_factor * m_particle_size / max_relative_v);
+	}
+	target = std::max(target, tc.dt_min);
+
+	if (target < m_dt)
+	{
+		m_dt = target;
+	}
+	else if (target > m_dt * (1 + tc.hysteresis))
+	{
+		m_dt = std::min(target, m_dt * tc.max_growth);
 	}
 }
 
@@ -486,7 +1527,7 @@ void simulation::particle_pair_interaction_global(particle &a, const particle &b
 	a.a = a.a + particle_pair_interaction(a, b);
 }
 
-vec3<double> simulation::particle_pair_interaction(const particle &a, const particle &b)
+vec3<double> simulation::particle_pair_interaction(const particle &a, const particle &b) const
 {
 	const vec3<double> ab = b.pos - a.pos;
 	const double distance_squared = ab * ab;
@@ -533,16 +1574,19 @@ inline double simulation::gravitational_force(const double &distance_squared) co
 	return m_g_const / distance_squared;
 }
 
+inline bool simulation::cells_are_close(const cell &a, const cell &b) const
+{
+	const vec3<double> r = b.m_cube.pos - a.m_cube.pos;
+	const double size_sum = (a.m_cube.half_size + b.m_cube.half_size) * m_cell_proximity_factor;
+	return r * r < size_sum * size_sum;
+}
+
 void simulation::cell_pair_interaction(cell &a, const cell &b)
 {
+	if (cells_are_close(a, b))
 	{
-		const vec3<double> r = b.m_cube.pos - a.m_cube.pos;
-		const double size_sum = (a.m_cube.half_size + b.m_cube.half_size) * m_cell_proximity_factor;
-		if (r * r < size_sum * size_sum)
-		{
-			a.m_surrounding_cells.push_back(&b);
-			return;
-		}
+		a.m_surrounding_cells.push_back(&b);
+		return;
 	}
 
 	const vec3<double> ab = b.m_center_of_mass - a.m_center_of_mass;
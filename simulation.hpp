@@ -7,9 +7,16 @@
 #include <condition_variable>
 #include <thread>
 #include <array>
+#include <algorithm>
+#include <functional>
+#include <span>
+#include <chrono>
+#include <string>
 
 #include "math.hpp"
 #include "barrier.hpp"
+#include "integrator.hpp"
+#include "perf_counters.hpp"
 
 struct particle
 {
@@ -20,7 +27,171 @@ struct particle
 
 class simulation
 {
+public:
+	struct timestep_control
+	{
+		bool enabled = false;
+		double dt_min = 0.0005;
+		double dt_max = 0.02;
+		/* dt <= accel_factor * sqrt(particle_size / max_acceleration) */
+		double accel_factor = 0.2;
+		/* dt <= velocity_factor * particle_size / max_relative_velocity */
+		double velocity_factor = 0.2;
+		/* The timestep only grows when the target exceeds it by this fraction. */
+		double hysteresis = 0.1;
+		/* Maximum factor by which the timestep may grow in one step. */
+		double max_growth = 1.05;
+	};
+
+	struct parameters
+	{
+		double size = 100.;
+		/* 0 uses all hardware threads. */
+		size_t num_threads = 0;
+		double dt = 0.005;
+		double particle_size = 0.4;
+		double g_const = 0.02;
+		double wall_collision_cor = 0.0;
+		double collision_max_force = 2;
+		double drag_factor = 0.05;
+		size_t cell_particles_limit = 48;
+		double cell_proximity_factor = 1.5;
+		timestep_control timestep;
+		size_t far_field_interval = 1;
+	};
+
+	/* Integrator state needed, besides the particles, to continue a run exactly. */
+	struct integration_state
+	{
+		uint64_t step = 0;
+		double sim_time = 0;
+		double dt = 0;
+		double prev_substep_dt = 0;
+		double far_field_elapsed = 0;
+		size_t far_field_countdown = 0;
+	};
+
+	/* Receives the positions of every interval-th step on the thread that advances the simulation.
+	 * The callback may take the positions by swapping the vector with one of its own and return
+	 * true, in which case that step is not published to get_particles_positions(). */
+	using snapshot_callback = std::function<bool(std::vector<vec3<double>> &positions, const uint64_t &step, const double &sim_time)>;
+
+	struct render_vertex
+	{
+		vec3<float> pos;
+		vec3<float> v;
+	};
+
+	/* Octree cell of a render snapshot. */
+	struct render_node
+	{
+		cube<float> bounds;
+		vec3<float> center_of_mass;
+		vec3<float> mean_velocity;
+		uint32_t num_particles = 0;
+		/* Leafs: index of their first particle in render_snapshot::vertices. */
+		uint32_t first = 0;
+		/* Index of the first node after this node's subtree, leafs have next == index + 1. */
+		uint32_t next = 0;
+	};
+
+	struct render_snapshot
+	{
+		std::vector<render_vertex> vertices;
+		/* The octree in depth-first order, empty before the first step. The particles of
+		 * each leaf are contiguous in vertices. */
+		std::vector<render_node> nodes;
+		double sim_time = 0;
+	};
+
+	/* Wall-clock seconds spent by the head thread in each phase, summed over steps. */
+	struct step_timings
+	{
+		size_t steps = 0;
+		double sim_time = 0;
+		double find_leafs = 0;
+		/* Parallel force and integration passes. */
+		double physics = 0;
+		double tree_update = 0;
+		double snapshot = 0;
+		double total = 0;
+	};
+
+	enum phase
+	{
+		phase_find_leafs,
+		/* Includes waking the workers. */
+		phase_center_of_mass,
+		phase_interactions,
+		/* Includes writing the exported positions and render snapshot. */
+		phase_integration,
+		phase_propagate_up,
+		phase_propagate_down,
+		phase_snapshot,
+		num_phases
+	};
+
+	static constexpr const char *phase_names[num_phases] = {"find_leafs", "center_of_mass", "interactions", "integration",
+	                                                        "propagate_up", "propagate_down", "snapshot"};
+
+	/* The barriers a worker waits at in a substep, named after the work they wait for. */
+	enum barrier_wait
+	{
+		/* Every worker awake. */
+		wait_start,
+		wait_center_of_mass,
+		wait_interactions,
+		/* The last worker done integrating, the end of the substep. */
+		wait_integration,
+		num_barrier_waits
+	};
+
+	static constexpr const char *barrier_wait_names[num_barrier_waits] = {"start", "center_of_mass", "interactions", "integration"};
+
+	/* Seconds a worker spent processing leafs and spinning at barriers, summed over substeps. */
+	struct worker_stats
+	{
+		double busy = 0;
+		double spin = 0;
+		/* spin split by barrier. */
+		std::array<double, num_barrier_waits> barrier_spin = {};
+	};
+
+	/* Statistics of one step. Phase times are wall-clock seconds summed over substeps. */
+	struct step_stats
+	{
+		uint64_t step = 0;
+		double dt = 0;
+		size_t num_leafs = 0;
+		std::array<double, num_phases> phases = {};
+		double total = 0;
+		/* Particle pairs evaluated, each pair within a leaf counted once. */
+		uint64_t particle_interactions = 0;
+		/* Leaf pairs evaluated through their centers of mass. */
+		uint64_t cell_interactions = 0;
+		std::vector<worker_stats> workers;
+		/* Hardware counters of the threads running each phase, summed over them. Spinning at barriers
+		 * is not counted. Zero unless enabled with set_perf_counters_enabled(). */
+		std::array<perf_counters::values, num_phases> counters = {};
+	};
+
+	/* Number of steps kept by get_step_stats(). */
+	static constexpr size_t stats_history = 1024;
+
 private:
+	/* Microbenchmarks of the internals, see bench_main.cpp. */
+	friend struct simulation_bench;
+
+	struct cell;
+
+	struct build_task
+	{
+		cell *c;
+		const std::pair<uint64_t, size_t> *order;
+		size_t num;
+		uint32_t depth;
+	};
+
     struct cell
     {
 		const size_t m_particles_limit;
@@ -36,6 +207,8 @@ private:
 
 		cell(cell *const parent, const cube<double> &c, const size_t &particles_limit);
 
+		void create_children();
+
 		void subdivide();
 
 		void unsubdivide();
@@ -50,16 +223,59 @@ private:
 
 		void get_particles(std::vector<particle> &particles) const;
 
-		void get_particles_positions(std::vector<vec3<double>> &particles) const;
+		void for_each_particle_block(const std::function<void(const particle *, const size_t &)> &f) const;
 
 		void calculate_center_of_mass();
+
+		/* Appends the subtree in depth-first order, and the node index of every non-empty leaf to
+		 * leaf_nodes, in find_leafs() order. */
+		void flatten(std::vector<render_node> &nodes, std::vector<uint32_t> &leaf_nodes) const;
+
+		/* Top-down build from (Morton key, index into particles) pairs sorted by key. Subtrees at
+		 * frontier_depth are pushed to frontier instead of being built, so they can be built in parallel. */
+		void build(const particle *particles, const std::pair<uint64_t, size_t> *order, const size_t &num, const uint32_t &depth,
+		           std::vector<build_task> *frontier, const uint32_t &frontier_depth);
 	};
 
+	static constexpr uint32_t morton_bits_per_axis = 21;
+
 	cell m_root;
     mutable std::mutex m_user_access_mutex;
 	static constexpr uint8_t m_particles_buffer_num = 3;
 	mutable std::array<std::vector<vec3<double>>, m_particles_buffer_num> m_particles_positions;
 	mutable bool m_swap_buffers = false;
+	/* Single precision positions and octree for rendering, triple-buffered like m_particles_positions. */
+	mutable std::array<render_snapshot, m_particles_buffer_num> m_render_snapshots;
+	mutable bool m_swap_render_buffers = false;
+	/* Incremented whenever a newer render snapshot is published. */
+	uint64_t m_render_generation = 0;
+	std::atomic_bool m_render_snapshot_enabled = false;
+	/* Filled by each worker during a step, padded so workers don't share cache lines. */
+	struct alignas(64) worker_counters
+	{
+		worker_stats stats;
+		std::chrono::steady_clock::time_point end;
+		uint64_t particle_interactions = 0;
+		uint64_t cell_interactions = 0;
+		std::array<perf_counters::values, num_phases> counters = {};
+	};
+	std::vector<worker_counters> m_worker_counters;
+	/* Leafs per traced batch, few enough to show stragglers, enough to keep the trace small. */
+	static constexpr size_t trace_batch_leafs = 16;
+	/* Set by the last thread reaching m_barrier_start and m_barrier, bounding the worker phases. */
+	std::array<std::chrono::steady_clock::time_point, 3> m_phase_marks;
+	size_t m_num_phase_marks = 0;
+	/* Ring buffer of the last stats_history steps, guarded by m_user_access_mutex. */
+	std::vector<step_stats> m_stats;
+	size_t m_stats_next = 0;
+	size_t m_stats_count = 0;
+	std::atomic<double> m_stats_log_interval = 0;
+	std::atomic_bool m_perf_counters_enabled = false;
+	bool m_export_render = false;
+	/* Offset of each leaf's particles in the exported positions, and its render node, set for the last substep. */
+	std::vector<size_t> m_leaf_offsets;
+	std::vector<uint32_t> m_leaf_nodes;
+	bool m_export_positions = false;
     std::vector<cell *> m_leafs;
 	std::thread m_head;
 	std::vector<std::thread> m_workers;
@@ -78,6 +294,21 @@ private:
 	double m_collision_max_force;
 	double m_drag_factor;
 	double m_cell_proximity_factor;
+	double m_substep_dt = 0;
+	double m_prev_substep_dt = 0;
+	double m_sim_time = 0;
+	uint64_t m_step = 0;
+	snapshot_callback m_snapshot_callback;
+	size_t m_snapshot_interval = 0;
+	timestep_control m_timestep_control, m_timestep_control_tmp;
+	std::atomic<double> m_max_acceleration_squared = 0;
+	std::atomic<double> m_max_relative_velocity_squared = 0;
+	/* r-RESPA: the far field is evaluated every m_far_field_interval steps and applied as a velocity impulse. */
+	size_t m_far_field_interval = 1, m_far_field_interval_tmp = 1;
+	size_t m_far_field_countdown = 0;
+	bool m_far_field_step = true;
+	double m_far_field_kick = 0;
+	double m_far_field_elapsed = 0;
 	std::vector<particle> m_temp_particles;
 	struct user_pointer{
 		bool active = false;
@@ -86,6 +317,13 @@ private:
 		double mass = 10000.0;
 		double drag_factor = 0.5;
 	} m_user_pointer, m_user_pointer_tmp;
+	struct
+	{
+		double dt = 0;
+		double sim_time = 0;
+	} m_time_tmp;
+
+	static size_t resolve_num_threads(const size_t &num_threads);
 
 	void spawn_worker_threads();
 
@@ -97,7 +335,9 @@ private:
 
 	void cell_pair_interaction(cell &a, const cell &b);
 
-	vec3<double> particle_pair_interaction(const particle &a, const particle &b);
+	bool cells_are_close(const cell &a, const cell &b) const;
+
+	vec3<double> particle_pair_interaction(const particle &a, const particle &b) const;
 
 	void particle_pair_interaction_local(particle &a, particle &b);
 
@@ -107,7 +347,13 @@ private:
 
 	void spherical_wall(particle &p);
 
-	void calculate_physics();
+	void calculate_physics(const size_t &worker);
+
+	/* Accumulates the forces on the particles of the i-th leaf of m_leafs. */
+	void leaf_interactions(const size_t &i, worker_counters &counters);
+
+	/* Writes the leaf's particles as render vertices and its center of mass and mean velocity to node. */
+	static void export_render_leaf(const std::vector<particle> &particles, render_vertex *vertices, render_node &node);
 
 	double collision_force(const double &distance_squared) const;
 
@@ -115,23 +361,111 @@ private:
 
 	void user_pointer_force(particle &p);
 
+	void update_timestep();
+
+	void begin_far_field_interval();
+
+	void advance(std::unique_lock<std::shared_mutex> &lock, step_timings &timings);
+
 	void progress();
 
 public:
-	simulation(const double &size, const size_t &num_threads, const double &dt, const double &particle_size,
-	           const double &g_const, const double &wall_collision_cor, const double &collision_max_force,
-	           const double &drag_factor, const size_t &cell_particles_limit, const double &cell_proximity_factor);
+	simulation(const parameters &params);
 
 	~simulation();
 
+	/* Throws if a parameter is out of range, naming it by its config key. */
+	static void validate_parameters(const parameters &params);
+
 	const std::vector<vec3<double>> &get_particles_positions() const;
 
+	/* Same positions and the velocities in single precision, with the octree they were sorted in,
+	 * filled by the worker threads. Published every step while enabled, also when the snapshot callback takes the double
+	 * precision positions. generation receives the value get_render_generation() had for the
+	 * returned snapshot. */
+	const render_snapshot &get_render_snapshot(uint64_t &generation) const;
+
+	/* Disabled by default, so that runs without a viewer don't pay for it. */
+	void set_render_snapshot_enabled(const bool &enabled)
+	{
+		m_render_snapshot_enabled = enabled;
+	}
+
+	/* Changes whenever get_render_snapshot() has a newer snapshot to return. */
+	uint64_t get_render_generation() const
+	{
+		std::lock_guard lock(m_user_access_mutex);
+		return m_render_generation;
+	}
+
 	void start();
 
 	void stop();
 
+	/* Advances the simulation on the calling thread and blocks until done. The worker
+	 * threads are kept alive between calls and released by stop() or the destructor.
+	 * Must not be called while the simulation runs freely after start(). */
+	step_timings step(const size_t &num_steps);
+
+	/* Advances by sim_time, rounded to the nearest step boundary. */
+	step_timings run_for(const double &sim_time);
+
 	void add(const particle &p);
 
+	/* Sorts the particles along the Morton curve and rebuilds the tree top-down in parallel.
+	 * Particles already in the simulation are kept. The tree is the one repeated add() calls build,
+	 * except that cells at depth morton_bits_per_axis are never subdivided. */
+	void add_bulk(std::span<const particle> particles);
+
+	/* The functions below access the particles directly and must not be used while the
+	 * simulation runs freely after start(). */
+
+	/* Calls f with the particles of each leaf, in depth-first order. */
+	void for_each_particle_block(const std::function<void(const particle *, const size_t &)> &f) const;
+
+	/* FNV-1a hash of the particles, in tree order, and of the integration state. Forces are only
+	 * written to particles of the leaf being processed and every sum runs in leaf order, so runs
+	 * from the same initial state produce the same hash for any num_threads. */
+	uint64_t state_hash() const;
+
+	/* Accelerations of the particles in for_each_particle_block() order from the octree solver,
+	 * without advancing. The far field is always evaluated and the user pointer is ignored. */
+	std::vector<vec3<double>> tree_accelerations();
+
+	/* Reference for tree_accelerations(): the same pair interactions summed over every pair of particles, O(N^2). */
+	std::vector<vec3<double>> direct_accelerations() const;
+
+	parameters get_parameters() const;
+
+	/* Up to max_steps of the last steps, oldest first. */
+	std::vector<step_stats> get_step_stats(const size_t &max_steps = stats_history) const;
+
+	/* Mean of every field over stats, per worker for the worker stats. */
+	static step_stats average_step_stats(const std::vector<step_stats> &stats);
+
+	/* One line with the phase times in ms, the worker spin fraction and the interaction counts. */
+	static std::string format_step_stats(const step_stats &stats);
+
+	/* Seconds between progress lines logged while the simulation runs freely after start(), 0 disables them. */
+	void set_stats_log_interval(const double &seconds)
+	{
+		m_stats_log_interval = seconds;
+	}
+
+	/* Samples hardware counters around every phase on the head and worker threads, see perf_counters.
+	 * Disabled by default since each sample is a system call. */
+	void set_perf_counters_enabled(const bool &enabled)
+	{
+		m_perf_counters_enabled = enabled;
+	}
+
+	/* interval = 0 or an empty callback disables it. */
+	void set_snapshot_callback(const size_t &interval, snapshot_callback callback);
+
+	integration_state get_integration_state() const;
+
+	void set_integration_state(const integration_state &state);
+
 	double get_size() const
 	{
 		return m_root.m_cube.half_size * 2;
@@ -182,4 +516,30 @@ public:
 		std::lock_guard lock(m_user_access_mutex);
 		m_user_pointer_tmp.drag_factor = drag_factor;
 	}
+
+	void set_timestep_control(const timestep_control &control)
+	{
+		std::lock_guard lock(m_user_access_mutex);
+		m_timestep_control_tmp = control;
+	}
+
+	/* Values above 1 enable multiple-timestep integration (r-RESPA): the octree far field is
+	 * recomputed every interval steps while contacts and drag are integrated every step. */
+	void set_far_field_interval(const size_t &interval)
+	{
+		std::lock_guard lock(m_user_access_mutex);
+		m_far_field_interval_tmp = std::max<size_t>(interval, 1);
+	}
+
+	double get_dt() const
+	{
+		std::lock_guard lock(m_user_access_mutex);
+		return m_time_tmp.dt;
+	}
+
+	double get_sim_time() const
+	{
+		std::lock_guard lock(m_user_access_mutex);
+		return m_time_tmp.sim_time;
+	}
 };
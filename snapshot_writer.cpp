@@ -0,0 +1,96 @@
+#include "snapshot_writer.hpp"
+#include "helper.hpp"
+
+snapshot_writer::snapshot_writer(const size_t &num_buffers, const size_t &buffer_capacity, const overflow_policy &policy, consumer consume) :
+	m_policy(policy), m_consumer(std::move(consume)), m_slots(std::max<size_t>(num_buffers, 1))
+{
+	for (slot &s : m_slots)
+	{
+		s.positions.reserve(buffer_capacity);
+	}
+
+	m_thread = std::thread([this]
+						   { run(); });
+}
+
+snapshot_writer::~snapshot_writer()
+{
+	{
+		std::lock_guard lock(m_mutex);
+		m_alive = false;
+	}
+	m_queued_cv.notify_all();
+	m_thread.join();
+}
+
+bool snapshot_writer::submit(std::vector<vec3<double>> &positions, const uint64_t &step, const double &sim_time)
+{
+	std::unique_lock lock(m_mutex);
+
+	const auto has_free_slot = [this]
+	{ return m_queued + m_busy < m_slots.size(); };
+
+	if (!has_free_slot())
+	{
+		if (m_policy == overflow_policy::drop)
+		{
+			++m_dropped;
+			return false;
+		}
+		m_released_cv.wait(lock, has_free_slot);
+	}
+
+	slot &s = m_slots[(m_head + m_queued + m_busy) % m_slots.size()];
+	s.positions.swap(positions);
+	s.step = step;
+	s.sim_time = sim_time;
+	++m_queued;
+
+	lock.unlock();
+	m_queued_cv.notify_one();
+	return true;
+}
+
+void snapshot_writer::flush()
+{
+	std::unique_lock lock(m_mutex);
+	m_released_cv.wait(lock, [this]
+					   { return m_queued == 0 && m_busy == 0; });
+}
+
+void snapshot_writer::run()
+{
+	std::unique_lock lock(m_mutex);
+	while (true)
+	{
+		/* Remaining snapshots are written before the thread exits. */
+		m_queued_cv.wait(lock, [this]
+						 { return m_queued > 0 || !m_alive; });
+		if (m_queued == 0)
+		{
+			return;
+		}
+
+		slot &s = m_slots[m_head];
+		--m_queued;
+		++m_busy;
+		lock.unlock();
+
+		bool written = false;
+		try
+		{
+			m_consumer(s.positions, s.step, s.sim_time);
+			written = true;
+		}
+		catch (const std::exception &ex)
+		{
+			ERROR("Snapshot writer: %s", ex.what());
+		}
+
+		lock.lock();
+		--m_busy;
+		++(written ? m_written : m_failed);
+		m_head = (m_head + 1) % m_slots.size();
+		m_released_cv.notify_all();
+	}
+}
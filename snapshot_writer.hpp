@@ -0,0 +1,85 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "math.hpp"
+
+/* Consumes position snapshots on a dedicated thread so output never runs on the stepping thread.
+ *
+ * Snapshots are exchanged through a ring of preallocated buffers: submit() swaps the caller's
+ * vector with a free buffer instead of copying it, and the writer thread hands the buffer back
+ * once the consumer is done with it. When every buffer is in flight, the overflow policy
+ * either blocks the caller until one is released or drops the snapshot. */
+class snapshot_writer
+{
+public:
+	enum class overflow_policy
+	{
+		block,
+		drop
+	};
+
+	using consumer = std::function<void(const std::vector<vec3<double>> &positions, const uint64_t &step, const double &sim_time)>;
+
+private:
+	struct slot
+	{
+		std::vector<vec3<double>> positions;
+		uint64_t step = 0;
+		double sim_time = 0;
+	};
+
+	const overflow_policy m_policy;
+	const consumer m_consumer;
+	std::vector<slot> m_slots;
+	/* Ring of slots starting at m_head: m_busy slots being written, then m_queued waiting. */
+	size_t m_head = 0;
+	size_t m_busy = 0;
+	size_t m_queued = 0;
+	size_t m_dropped = 0;
+	size_t m_written = 0;
+	size_t m_failed = 0;
+	bool m_alive = true;
+	mutable std::mutex m_mutex;
+	std::condition_variable m_queued_cv;
+	std::condition_variable m_released_cv;
+	std::thread m_thread;
+
+	void run();
+
+public:
+	snapshot_writer(const size_t &num_buffers, const size_t &buffer_capacity, const overflow_policy &policy, consumer consume);
+	~snapshot_writer();
+
+	snapshot_writer(const snapshot_writer &) = delete;
+	snapshot_writer &operator=(const snapshot_writer &) = delete;
+
+	/* Returns true if the snapshot was taken, in which case positions now holds a spare buffer. */
+	bool submit(std::vector<vec3<double>> &positions, const uint64_t &step, const double &sim_time);
+
+	/* Blocks until every submitted snapshot has been written. */
+	void flush();
+
+	size_t get_dropped() const
+	{
+		std::lock_guard lock(m_mutex);
+		return m_dropped;
+	}
+
+	size_t get_written() const
+	{
+		std::lock_guard lock(m_mutex);
+		return m_written;
+	}
+
+	/* Snapshots the consumer threw on, they count as neither written nor dropped. */
+	size_t get_failed() const
+	{
+		std::lock_guard lock(m_mutex);
+		return m_failed;
+	}
+};
@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "splat_renderer.hpp"
+#include "parallel.hpp"
+
+namespace
+{
+	/* Same camera as particle_renderer::configure_pipeline with an identity world matrix. */
+	float camera_distance(const double &sim_size, const float &fov, const float &zoom)
+	{
+		return sim_size * 0.5f / sinf(fov * 0.5f) * zoom;
+	}
+}
+
+splat_renderer::splat_renderer(const size_t &width, const size_t &height, const double &sim_size, const double &particle_size,
+                               const float &particle_scale, const float &fov, const float &zoom, const size_t &num_threads) :
+	m_num_threads(num_threads > 0 ? num_threads : std::max<size_t>(std::thread::hardware_concurrency(), 1)),
+	m_tiles_x((width + m_tile_size - 1) / m_tile_size),
+	m_tiles_y((height + m_tile_size - 1) / m_tile_size),
+	m_near(std::max((camera_distance(sim_size, fov, zoom) - sim_size * 0.5) * 0.9, 0.1)),
+	m_far((camera_distance(sim_size, fov, zoom) + sim_size * 0.5) * 1.1),
+	m_transform(identity_matrix() * look_to_matrix({0, 0, -camera_distance(sim_size, fov, zoom)}, {0, 0, 1}, {0, 1, 0}) *
+	            perspective_projection_matrix(fov, m_near, m_far, static_cast<float>(width) / height)),
+	m_point_size(particle_size * height / tanf(fov / 2) * particle_scale),
+	m_tile_offsets(m_num_threads, std::vector<uint32_t>(m_tiles_x * m_tiles_y))
+{
+	m_image.width = width;
+	m_image.height = height;
+	m_image.pixels.resize(width * height * 3);
+}
+
+template <typename F>
+void splat_renderer::for_each_tile(const splat &s, F &&f) const
+{
+	/* Points are drawn at least one pixel wide, like GL points. */
+	const float extent = std::max(s.radius, 1.f);
+	const size_t x0 = std::max(s.x - extent, 0.f) / m_tile_size;
+	const size_t y0 = std::max(s.y - extent, 0.f) / m_tile_size;
+	const size_t x1 = std::min<size_t>((s.x + extent) / m_tile_size, m_tiles_x - 1);
+	const size_t y1 = std::min<size_t>((s.y + extent) / m_tile_size, m_tiles_y - 1);
+	for (size_t y = y0; y <= y1; ++y)
+	{
+		for (size_t x = x0; x <= x1; ++x)
+		{
+			f(y * m_tiles_x + x);
+		}
+	}
+}
+
+void splat_renderer::rasterize_tile(const size_t &tile, std::vector<float> &coverage)
+{
+	const size_t tile_x = tile % m_tiles_x * m_tile_size;
+	const size_t tile_y = tile / m_tiles_x * m_tile_size;
+	const size_t width = std::min(m_tile_size, m_image.width - tile_x);
+	const size_t height = std::min(m_tile_size, m_image.height - tile_y);
+	std::fill(coverage.begin(), coverage.end(), 0.f);
+
+	const auto add = [&](const long &x, const long &y, const float &weight)
+	{
+		const long lx = x - static_cast<long>(tile_x);
+		const long ly = y - static_cast<long>(tile_y);
+		if (lx >= 0 && ly >= 0 && lx < static_cast<long>(width) && ly < static_cast<long>(height))
+		{
+			coverage[ly * m_tile_size + lx] += weight;
+		}
+	};
+
+	const uint32_t begin = m_tile_offsets[0][tile];
+	const uint32_t end = tile + 1 < m_tile_offsets[0].size() ? m_tile_offsets[0][tile + 1] : m_binned.size();
+	for (uint32_t i = begin; i < end; ++i)
+	{
+		const splat &s = m_splats[m_binned[i]];
+		if (s.radius <= 1)
+		{
+			/* One pixel of coverage, split bilinearly between the four nearest pixel centers. */
+			const float fx = s.x - 0.5f;
+			const float fy = s.y - 0.5f;
+			const long x = static_cast<long>(floorf(fx));
+			const long y = static_cast<long>(floorf(fy));
+			const float wx = fx - x;
+			const float wy = fy - y;
+			add(x, y, (1 - wx) * (1 - wy));
+			add(x + 1, y, wx * (1 - wy));
+			add(x, y + 1, (1 - wx) * wy);
+			add(x + 1, y + 1, wx * wy);
+		}
+		else
+		{
+			const long x0 = std::max<long>(floorf(s.x - s.radius), tile_x);
+			const long y0 = std::max<long>(floorf(s.y - s.radius), tile_y);
+			const long x1 = std::min<long>(ceilf(s.x + s.radius), tile_x + width - 1);
+			const long y1 = std::min<long>(ceilf(s.y + s.radius), tile_y + height - 1);
+			for (long y = y0; y <= y1; ++y)
+			{
+				for (long x = x0; x <= x1; ++x)
+				{
+					const float dx = x + 0.5f - s.x;
+					const float dy = y + 0.5f - s.y;
+					if (dx * dx + dy * dy <= s.radius * s.radius)
+					{
+						add(x, y, 1);
+					}
+				}
+			}
+		}
+	}
+
+	const float log_transmittance = logf(1 - m_particle_alpha);
+	for (size_t y = 0; y < height; ++y)
+	{
+		uint8_t *row = m_image.pixels.data() + ((tile_y + y) * m_image.width + tile_x) * 3;
+		for (size_t x = 0; x < width; ++x)
+		{
+			const float intensity = 1 - expf(coverage[y * m_tile_size + x] * log_transmittance);
+			const uint8_t v = static_cast<uint8_t>(intensity * 255 + 0.5f);
+			row[x * 3] = row[x * 3 + 1] = row[x * 3 + 2] = v;
+		}
+	}
+}
+
+const rgb_image &splat_renderer::render(const std::vector<vec3<double>> &positions)
+{
+	const size_t num = positions.size();
+	const size_t num_tiles = m_tiles_x * m_tiles_y;
+	m_splats.resize(num);
+
+	/* Each thread projects one contiguous part of the particles and counts its splats per tile. */
+	const auto part = [&](const size_t &t)
+	{
+		return std::make_pair(num * t / m_num_threads, num * (t + 1) / m_num_threads);
+	};
+	parallel_for(m_num_threads, m_num_threads, [&](const size_t &begin, const size_t &end)
+	{
+		for (size_t t = begin; t < end; ++t)
+		{
+			std::vector<uint32_t> &counts = m_tile_offsets[t];
+			std::fill(counts.begin(), counts.end(), 0);
+
+			const auto [first, last] = part(t);
+			for (size_t i = first; i < last; ++i)
+			{
+				const std::array<float, 4> clip = m_transform.transform(vec3<float>::type_cast(positions[i]));
+				splat &s = m_splats[i];
+				s.radius = -1;
+				if (clip[3] < m_near || clip[3] > m_far)
+				{
+					continue;
+				}
+
+				const float radius = m_point_size / clip[3] * 0.5f;
+				const float x = (clip[0] / clip[3] * 0.5f + 0.5f) * m_image.width;
+				const float y = (0.5f - clip[1] / clip[3] * 0.5f) * m_image.height;
+				const float extent = std::max(radius, 1.f);
+				if (x + extent < 0 || y + extent < 0 || x - extent >= m_image.width || y - extent >= m_image.height)
+				{
+					continue;
+				}
+
+				s = {x, y, radius};
+				for_each_tile(s, [&counts](const size_t &tile)
+							  { ++counts[tile]; });
+			}
+		}
+	});
+
+	/* Tile-major offsets, so the splats of a tile are contiguous and in particle order. */
+	uint32_t total = 0;
+	for (size_t tile = 0; tile < num_tiles; ++tile)
+	{
+		for (std::vector<uint32_t> &offsets : m_tile_offsets)
+		{
+			const uint32_t count = offsets[tile];
+			offsets[tile] = total;
+			total += count;
+		}
+	}
+	m_binned.resize(total);
+
+	/* Thread 0's offsets are the start of every tile; the scatter advances a copy of them. */
+	std::vector<std::vector<uint32_t>> cursors = m_tile_offsets;
+	parallel_for(m_num_threads, m_num_threads, [&](const size_t &begin, const size_t &end)
+	{
+		for (size_t t = begin; t < end; ++t)
+		{
+			std::vector<uint32_t> &cursor = cursors[t];
+			const auto [first, last] = part(t);
+			for (size_t i = first; i < last; ++i)
+			{
+				if (m_splats[i].radius >= 0)
+				{
+					for_each_tile(m_splats[i], [&](const size_t &tile)
+								  { m_binned[cursor[tile]++] = i; });
+				}
+			}
+		}
+	});
+
+	std::atomic_size_t next_tile = 0;
+	parallel_for(m_num_threads, m_num_threads, [&](const size_t &, const size_t &)
+	{
+		std::vector<float> coverage(m_tile_size * m_tile_size);
+		size_t tile;
+		while ((tile = next_tile++) < num_tiles)
+		{
+			rasterize_tile(tile, coverage);
+		}
+	});
+
+	return m_image;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "math.hpp"
+#include "image.hpp"
+
+/* Software point splatting for machines without a GPU. Uses the camera of particle_renderer and
+ * composites like its blending: a pixel covered n times by particles of alpha 0.025 has intensity
+ * 1 - 0.975^n.
+ *
+ * Visible particles are binned into screen tiles, then every tile is accumulated and tone-mapped
+ * by one thread without touching the buffers of others. */
+class splat_renderer
+{
+	struct splat
+	{
+		float x, y, radius;
+	};
+
+	static constexpr size_t m_tile_size = 32;
+	static constexpr float m_particle_alpha = 0.025f;
+
+	const size_t m_num_threads;
+	const size_t m_tiles_x, m_tiles_y;
+	const float m_near, m_far;
+	const mat4<float> m_transform;
+	/* Point diameter in pixels at unit depth. */
+	const float m_point_size;
+
+	rgb_image m_image;
+	std::vector<splat> m_splats;
+	/* Per thread, then per tile: splat counts, then offsets into m_binned. */
+	std::vector<std::vector<uint32_t>> m_tile_offsets;
+	std::vector<uint32_t> m_binned;
+
+	/* Calls f(tile) for every tile the splat touches. */
+	template <typename F>
+	void for_each_tile(const splat &s, F &&f) const;
+
+	void rasterize_tile(const size_t &tile, std::vector<float> &coverage);
+
+public:
+	/* fov in radians, zoom as in particle_renderer::set_zoom. num_threads = 0 uses all hardware threads. */
+	splat_renderer(const size_t &width, const size_t &height, const double &sim_size, const double &particle_size,
+	               const float &particle_scale, const float &fov, const float &zoom, const size_t &num_threads);
+
+	const rgb_image &render(const std::vector<vec3<double>> &positions);
+};
@@ -0,0 +1,111 @@
+#include <cstdio>
+
+#include "tracer.hpp"
+#include "output_file.hpp"
+#include "helper.hpp"
+
+std::atomic_bool tracer::s_enabled = false;
+std::mutex tracer::s_mutex;
+std::vector<std::unique_ptr<tracer::thread_buffer>> tracer::s_buffers;
+thread_local tracer::thread_buffer *tracer::s_local_buffer = nullptr;
+
+namespace
+{
+	thread_local std::string thread_name;
+
+	std::string escape(const std::string &str)
+	{
+		std::string result;
+		for (const char c : str)
+		{
+			if (c == '"' || c == '\\')
+			{
+				result += '\\';
+			}
+			result += c;
+		}
+		return result;
+	}
+}
+
+tracer::thread_buffer &tracer::local_buffer()
+{
+	if (s_local_buffer == nullptr)
+	{
+		std::lock_guard lock(s_mutex);
+		s_buffers.push_back(std::make_unique<thread_buffer>());
+		thread_buffer &buffer = *s_buffers.back();
+		buffer.id = static_cast<uint32_t>(s_buffers.size());
+		buffer.name = thread_name.empty() ? "thread " + std::to_string(buffer.id) : thread_name;
+		buffer.events.reserve(4096);
+		s_local_buffer = &buffer;
+	}
+	return *s_local_buffer;
+}
+
+void tracer::set_thread_name(const std::string &name)
+{
+	thread_name = name;
+	if (s_local_buffer != nullptr)
+	{
+		std::lock_guard lock(s_mutex);
+		s_local_buffer->name = name;
+	}
+}
+
+void tracer::record(const char *name, const clock::time_point &begin, const clock::time_point &end, const char *arg_name, const uint64_t &arg)
+{
+	local_buffer().events.push_back({name, arg_name, arg, begin, end});
+}
+
+void tracer::write(const std::string &path)
+{
+	std::lock_guard lock(s_mutex);
+
+	clock::time_point epoch = clock::time_point::max();
+	size_t num_events = 0;
+	for (const auto &buffer : s_buffers)
+	{
+		for (const event &e : buffer->events)
+		{
+			epoch = std::min(epoch, e.begin);
+		}
+		num_events += buffer->events.size();
+	}
+
+	output_file file(path, false);
+	const auto write_str = [&file](const std::string &str)
+	{
+		file.write(str.data(), str.size());
+	};
+
+	write_str("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	char line[512];
+	for (const auto &buffer : s_buffers)
+	{
+		std::snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+		              first ? "" : ",\n", buffer->id, escape(buffer->name).c_str());
+		write_str(line);
+		first = false;
+
+		for (const event &e : buffer->events)
+		{
+			const double ts = std::chrono::duration<double, std::micro>(e.begin - epoch).count();
+			const double dur = std::chrono::duration<double, std::micro>(e.end - e.begin).count();
+			int length = std::snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+			                           e.name, buffer->id, ts, dur);
+			if (e.arg_name != nullptr)
+			{
+				length += std::snprintf(line + length, sizeof(line) - length, ",\"args\":{\"%s\":%llu}", e.arg_name, static_cast<unsigned long long>(e.arg));
+			}
+			std::snprintf(line + length, sizeof(line) - length, "}");
+			write_str(line);
+		}
+		buffer->events.clear();
+	}
+	write_str("\n]}\n");
+	file.close();
+
+	INFO("Trace with %zu events written to '%s'", num_events, path.c_str());
+}
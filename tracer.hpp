@@ -0,0 +1,101 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Opt-in timeline of the work done by every thread, written as Chrome trace JSON that can be
+ * opened in chrome://tracing or Perfetto.
+ *
+ * Each thread records complete events into its own buffer, so recording takes no lock. A
+ * buffer is registered the first time its thread records an event and outlives the thread.
+ * Event and argument names must have static storage duration (string literals). */
+class tracer
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	/* Records the event from construction to destruction. */
+	class scope
+	{
+		const char *const m_name;
+		const bool m_enabled;
+		clock::time_point m_begin;
+		const char *m_arg_name = nullptr;
+		uint64_t m_arg = 0;
+
+	public:
+		scope(const char *name) : m_name(name), m_enabled(is_enabled())
+		{
+			if (m_enabled)
+			{
+				m_begin = clock::now();
+			}
+		}
+
+		~scope()
+		{
+			if (m_enabled)
+			{
+				record(m_name, m_begin, clock::now(), m_arg_name, m_arg);
+			}
+		}
+
+		scope(const scope &) = delete;
+		scope &operator=(const scope &) = delete;
+
+		void set_arg(const char *name, const uint64_t &value)
+		{
+			m_arg_name = name;
+			m_arg = value;
+		}
+	};
+
+private:
+	struct event
+	{
+		const char *name;
+		const char *arg_name;
+		uint64_t arg;
+		clock::time_point begin;
+		clock::time_point end;
+	};
+
+	struct thread_buffer
+	{
+		uint32_t id;
+		std::string name;
+		std::vector<event> events;
+	};
+
+	static std::atomic_bool s_enabled;
+	static std::mutex s_mutex;
+	static std::vector<std::unique_ptr<thread_buffer>> s_buffers;
+	static thread_local thread_buffer *s_local_buffer;
+
+	static thread_buffer &local_buffer();
+
+public:
+	static void enable(const bool &enabled)
+	{
+		s_enabled = enabled;
+	}
+
+	static bool is_enabled()
+	{
+		return s_enabled.load(std::memory_order_relaxed);
+	}
+
+	/* Name of the calling thread in the trace, may be set before tracing is enabled. */
+	static void set_thread_name(const std::string &name);
+
+	static void record(const char *name, const clock::time_point &begin, const clock::time_point &end,
+	                   const char *arg_name = nullptr, const uint64_t &arg = 0);
+
+	/* Writes every recorded event and clears the buffers. The traced threads must be idle, e.g.
+	 * between simulation::step() calls or after simulation::stop(). Throws on failure. */
+	static void write(const std::string &path);
+};
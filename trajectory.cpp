@@ -0,0 +1,429 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+
+#include "trajectory.hpp"
+#include "endian.hpp"
+#include "helper.hpp"
+
+namespace
+{
+	constexpr uint32_t max_bits_per_axis = 21;
+	constexpr size_t rice_block_size = 4096;
+	constexpr uint32_t rice_parameter_bits = 6;
+	/* Quotients from this value on are escaped and stored in binary. */
+	constexpr uint64_t unary_limit = 24;
+	constexpr uint32_t escape_length_bits = 6;
+
+	struct frame_header
+	{
+		uint64_t step;
+		double sim_time;
+		uint64_t num_particles;
+		uint64_t payload_size;
+	};
+
+	uint64_t spread_bits(uint64_t v)
+	{
+		v &= 0x1fffff;
+		v = (v | v << 32) & 0x1f00000000ffff;
+		v = (v | v << 16) & 0x1f0000ff0000ff;
+		v = (v | v << 8) & 0x100f00f00f00f00f;
+		v = (v | v << 4) & 0x10c30c30c30c30c3;
+		v = (v | v << 2) & 0x1249249249249249;
+		return v;
+	}
+
+	uint64_t compact_bits(uint64_t v)
+	{
+		v &= 0x1249249249249249;
+		v = (v | v >> 2) & 0x10c30c30c30c30c3;
+		v = (v | v >> 4) & 0x100f00f00f00f00f;
+		v = (v | v >> 8) & 0x1f0000ff0000ff;
+		v = (v | v >> 16) & 0x1f00000000ffff;
+		v = (v | v >> 32) & 0x1fffff;
+		return v;
+	}
+
+	class bit_writer
+	{
+		std::vector<uint8_t> &m_out;
+		uint64_t m_acc = 0;
+		uint32_t m_fill = 0;
+
+	public:
+		explicit bit_writer(std::vector<uint8_t> &out) : m_out(out) {}
+
+		/* LSB first, at most 32 bits per call. */
+		void write(const uint64_t &value, const uint32_t &bits)
+		{
+			m_acc |= (value & ((uint64_t{1} << bits) - 1)) << m_fill;
+			m_fill += bits;
+			while (m_fill >= 8)
+			{
+				m_out.push_back(static_cast<uint8_t>(m_acc));
+				m_acc >>= 8;
+				m_fill -= 8;
+			}
+		}
+
+		void write_long(const uint64_t &value, const uint32_t &bits)
+		{
+			if (bits > 32)
+			{
+				write(value, 32);
+				write(value >> 32, bits - 32);
+			}
+			else
+			{
+				write(value, bits);
+			}
+		}
+
+		void flush()
+		{
+			if (m_fill > 0)
+			{
+				m_out.push_back(static_cast<uint8_t>(m_acc));
+				m_acc = 0;
+				m_fill = 0;
+			}
+		}
+	};
+
+	class bit_reader
+	{
+		const uint8_t *m_data;
+		const uint8_t *const m_end;
+		uint64_t m_acc = 0;
+		uint32_t m_fill = 0;
+
+		void refill()
+		{
+			while (m_fill <= 56)
+			{
+				if (m_data == m_end)
+				{
+					if (m_fill == 0)
+					{
+						THROW("Trajectory frame is truncated");
+					}
+					return;
+				}
+				m_acc |= uint64_t{*m_data++} << m_fill;
+				m_fill += 8;
+			}
+		}
+
+	public:
+		bit_reader(const uint8_t *data, const size_t &size) : m_data(data), m_end(data + size) {}
+
+		uint64_t read(const uint32_t &bits)
+		{
+			if (bits == 0)
+			{
+				return 0;
+			}
+			if (m_fill < bits)
+			{
+				refill();
+				if (m_fill < bits)
+				{
+					THROW("Trajectory frame is truncated");
+				}
+			}
+			const uint64_t value = m_acc & ((uint64_t{1} << bits) - 1);
+			m_acc >>= bits;
+			m_fill -= bits;
+			return value;
+		}
+
+		uint64_t read_long(const uint32_t &bits)
+		{
+			if (bits > 32)
+			{
+				const uint64_t low = read(32);
+				return low | read(bits - 32) << 32;
+			}
+			return read(bits);
+		}
+
+		uint64_t read_unary(const uint64_t &limit)
+		{
+			uint64_t q = 0;
+			while (q < limit && read(1))
+			{
+				++q;
+			}
+			return q;
+		}
+	};
+
+	uint64_t rice_cost(const uint64_t *deltas, const size_t &num, const uint32_t &k)
+	{
+		uint64_t bits = 0;
+		for (size_t i = 0; i < num; ++i)
+		{
+			const uint64_t q = deltas[i] >> k;
+			bits += k + (q < unary_limit ? q + 1 : unary_limit + escape_length_bits + std::bit_width(q));
+		}
+		return bits;
+	}
+
+	void read_at(std::FILE *file, const uint64_t &offset, void *data, const size_t &size)
+	{
+		if (std::fseek(file, static_cast<long>(offset), SEEK_SET) != 0 || std::fread(data, 1, size, file) != size)
+		{
+			THROW("Failed to read trajectory");
+		}
+	}
+}
+
+trajectory_encoder::trajectory_encoder(const double &half_size, const double &precision) : m_half_size(half_size)
+{
+	ASSERT_EX_M(precision > 0, "Trajectory precision must be positive");
+
+	const double cells = std::ceil(half_size * 2 / precision);
+	m_bits_per_axis = std::max<uint32_t>(1, static_cast<uint32_t>(std::ceil(std::log2(cells))));
+	if (m_bits_per_axis > max_bits_per_axis)
+	{
+		THROW_PRINTF("Trajectory precision %g is finer than %u bits per axis allow", precision, max_bits_per_axis);
+	}
+}
+
+void trajectory_encoder::encode(const vec3<double> *positions, const size_t &num, std::vector<uint8_t> &payload)
+{
+	const uint64_t max_q = (uint64_t{1} << m_bits_per_axis) - 1;
+	const double scale = (max_q + 1) / (m_half_size * 2);
+	const auto quantize = [&](const double &x)
+	{
+		const double q = std::floor((x + m_half_size) * scale);
+		return static_cast<uint64_t>(std::clamp(q, 0., static_cast<double>(max_q)));
+	};
+
+	m_codes.resize(num);
+	for (size_t i = 0; i < num; ++i)
+	{
+		const vec3<double> &p = positions[i];
+		/* Clamping keeps finite positions outside the volume in range, NaN would make the cast undefined. */
+		if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) [[unlikely]]
+		{
+			THROW_PRINTF("Particle %zu has a non-finite position, the trajectory frame is rejected", i);
+		}
+		m_codes[i] = spread_bits(quantize(p.x)) << 2 | spread_bits(quantize(p.y)) << 1 | spread_bits(quantize(p.z));
+	}
+	std::sort(m_codes.begin(), m_codes.end());
+
+	/* In-place deltas along the curve; they are small and roughly geometrically distributed. */
+	for (size_t i = num; i-- > 1;)
+	{
+		m_codes[i] -= m_codes[i - 1];
+	}
+
+	payload.clear();
+	bit_writer writer(payload);
+	for (size_t begin = 0; begin < num; begin += rice_block_size)
+	{
+		const size_t block = std::min(rice_block_size, num - begin);
+		const uint64_t *const deltas = m_codes.data() + begin;
+
+		long double sum = 0;
+		for (size_t i = 0; i < block; ++i)
+		{
+			sum += deltas[i];
+		}
+		const uint64_t mean = static_cast<uint64_t>(sum / block);
+		const uint32_t guess = mean > 0 ? std::bit_width(mean) - 1 : 0;
+
+		uint32_t k = guess;
+		uint64_t best = rice_cost(deltas, block, k);
+		for (const uint32_t candidate : {guess - 1, guess + 1})
+		{
+			if (candidate < 64 - unary_limit)
+			{
+				const uint64_t cost = rice_cost(deltas, block, candidate);
+				if (cost < best)
+				{
+					best = cost;
+					k = candidate;
+				}
+			}
+		}
+
+		writer.write(k, rice_parameter_bits);
+		for (size_t i = 0; i < block; ++i)
+		{
+			const uint64_t q = deltas[i] >> k;
+			if (q < unary_limit)
+			{
+				writer.write((uint64_t{1} << q) - 1, static_cast<uint32_t>(q + 1));
+			}
+			else
+			{
+				writer.write((uint64_t{1} << unary_limit) - 1, unary_limit);
+				const uint32_t length = std::bit_width(q);
+				writer.write(length, escape_length_bits);
+				writer.write_long(q, length);
+			}
+			writer.write_long(deltas[i], k);
+		}
+	}
+	writer.flush();
+}
+
+void trajectory_encoder::decode(const uint8_t *payload, const size_t &payload_size, const size_t &num,
+                                const double &half_size, const uint32_t &bits_per_axis, std::vector<vec3<double>> &positions)
+{
+	const double cell = half_size * 2 / static_cast<double>(uint64_t{1} << bits_per_axis);
+	const auto dequantize = [&](const uint64_t &q)
+	{
+		return (static_cast<double>(q) + 0.5) * cell - half_size;
+	};
+
+	positions.resize(num);
+	bit_reader reader(payload, payload_size);
+	uint64_t code = 0;
+	for (size_t begin = 0; begin < num; begin += rice_block_size)
+	{
+		const size_t block = std::min(rice_block_size, num - begin);
+		const uint32_t k = static_cast<uint32_t>(reader.read(rice_parameter_bits));
+		for (size_t i = 0; i < block; ++i)
+		{
+			uint64_t q = reader.read_unary(unary_limit);
+			if (q == unary_limit)
+			{
+				const uint32_t length = static_cast<uint32_t>(reader.read(escape_length_bits));
+				q = reader.read_long(length);
+			}
+			code += q << k | reader.read_long(k);
+
+			positions[begin + i] = {dequantize(compact_bits(code >> 2)), dequantize(compact_bits(code >> 1)), dequantize(compact_bits(code))};
+		}
+	}
+}
+
+trajectory_writer::trajectory_writer(const std::string &path, const double &half_size, const double &precision, const bool &direct) :
+	m_file(path, direct), m_encoder(half_size, precision)
+{
+	trajectory_file_header header = {};
+	std::memcpy(header.magic, trajectory_file_header::magic_value, sizeof(header.magic));
+	header.version = to_little_endian(trajectory_file_header::current_version);
+	header.bits_per_axis = to_little_endian(m_encoder.get_bits_per_axis());
+	header.half_size = to_little_endian(half_size);
+	header.precision = to_little_endian(precision);
+	m_file.write(&header, sizeof(header));
+}
+
+trajectory_writer::~trajectory_writer()
+{
+	try
+	{
+		close();
+	}
+	catch (const std::exception &ex)
+	{
+		ERROR("%s", ex.what());
+	}
+}
+
+void trajectory_writer::write_frame(const vec3<double> *positions, const size_t &num, const uint64_t &step, const double &sim_time)
+{
+	m_encoder.encode(positions, num, m_payload);
+	write_encoded_frame(m_payload.data(), m_payload.size(), num, step, sim_time);
+}
+
+void trajectory_writer::write_encoded_frame(const uint8_t *payload, const size_t &payload_size, const size_t &num, const uint64_t &step, const double &sim_time)
+{
+	m_index.push_back({m_file.get_offset(), step, sim_time, num});
+
+	const frame_header header = {to_little_endian(step), to_little_endian(sim_time), to_little_endian<uint64_t>(num), to_little_endian<uint64_t>(payload_size)};
+	m_file.write(&header, sizeof(header));
+	m_file.write(payload, payload_size);
+}
+
+void trajectory_writer::close()
+{
+	if (m_closed)
+	{
+		return;
+	}
+	m_closed = true;
+
+	trajectory_footer footer = {to_little_endian(m_file.get_offset()), to_little_endian<uint64_t>(m_index.size()), {}};
+	std::memcpy(footer.magic, trajectory_footer::magic_value, sizeof(footer.magic));
+
+	for (trajectory_frame_info info : m_index)
+	{
+		info = {to_little_endian(info.offset), to_little_endian(info.step), to_little_endian(info.sim_time), to_little_endian(info.num_particles)};
+		m_file.write(&info, sizeof(info));
+	}
+	m_file.write(&footer, sizeof(footer));
+	m_file.close();
+}
+
+trajectory_reader::trajectory_reader(const std::string &path)
+{
+	m_file = std::fopen(path.c_str(), "rb");
+	if (m_file == nullptr)
+	{
+		THROW_PRINTF("Failed to open trajectory '%s'", path.c_str());
+	}
+
+	try
+	{
+		read_at(m_file, 0, &m_header, sizeof(m_header));
+		if (std::memcmp(m_header.magic, trajectory_file_header::magic_value, sizeof(m_header.magic)) != 0)
+		{
+			THROW_PRINTF("'%s' is not a trajectory", path.c_str());
+		}
+		m_header.version = from_little_endian(m_header.version);
+		m_header.bits_per_axis = from_little_endian(m_header.bits_per_axis);
+		m_header.half_size = from_little_endian(m_header.half_size);
+		m_header.precision = from_little_endian(m_header.precision);
+		if (m_header.version != trajectory_file_header::current_version || m_header.bits_per_axis > max_bits_per_axis)
+		{
+			THROW_PRINTF("Unsupported trajectory version %u in '%s'", m_header.version, path.c_str());
+		}
+
+		trajectory_footer footer;
+		if (std::fseek(m_file, -static_cast<long>(sizeof(footer)), SEEK_END) != 0 || std::fread(&footer, sizeof(footer), 1, m_file) != 1 ||
+		    std::memcmp(footer.magic, trajectory_footer::magic_value, sizeof(footer.magic)) != 0)
+		{
+			THROW_PRINTF("Trajectory '%s' has no frame index, it was not closed properly", path.c_str());
+		}
+
+		m_index.resize(from_little_endian(footer.num_frames));
+		read_at(m_file, from_little_endian(footer.index_offset), m_index.data(), m_index.size() * sizeof(trajectory_frame_info));
+		for (trajectory_frame_info &info : m_index)
+		{
+			info = {from_little_endian(info.offset), from_little_endian(info.step), from_little_endian(info.sim_time), from_little_endian(info.num_particles)};
+		}
+	}
+	catch (...)
+	{
+		std::fclose(m_file);
+		throw;
+	}
+}
+
+trajectory_reader::~trajectory_reader()
+{
+	std::fclose(m_file);
+}
+
+void trajectory_reader::read_frame(const size_t &frame, std::vector<vec3<double>> &positions)
+{
+	ASSERT_EX_M(frame < m_index.size(), "Trajectory frame index is out of range");
+
+	frame_header header;
+	read_at(m_file, m_index[frame].offset, &header, sizeof(header));
+	m_payload.resize(from_little_endian(header.payload_size));
+	if (!m_payload.empty() && std::fread(m_payload.data(), 1, m_payload.size(), m_file) != m_payload.size())
+	{
+		THROW("Failed to read trajectory");
+	}
+
+	trajectory_encoder::decode(m_payload.data(), m_payload.size(), from_little_endian(header.num_particles),
+	                           m_header.half_size, m_header.bits_per_axis, positions);
+}
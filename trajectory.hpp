@@ -0,0 +1,136 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "math.hpp"
+#include "output_file.hpp"
+
+/* Compressed trajectory of particle position snapshots.
+ *
+ * Positions are quantized on a regular grid of cells no larger than the requested precision
+ * spanning the simulation cube, so the error per coordinate is at most precision / 2.
+ * Snapshots carry no particle identities, so each frame is stored as a point set: the
+ * quantized positions are sorted along the Morton curve, the differences between
+ * consecutive Morton codes are Rice coded with a parameter chosen per block, and decoding
+ * yields the positions in Morton order.
+ *
+ * Layout, little-endian: file header, frames (frame header + payload), frame index, footer.
+ * The footer at the end of the file points to the index, so readers can seek to any frame. */
+
+struct trajectory_file_header
+{
+	static constexpr char magic_value[8] = {'P', 'S', 'I', 'M', 'T', 'R', 'A', 'J'};
+	static constexpr uint32_t current_version = 1;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t bits_per_axis;
+	double half_size;
+	double precision;
+};
+
+struct trajectory_frame_info
+{
+	uint64_t offset;
+	uint64_t step;
+	double sim_time;
+	uint64_t num_particles;
+};
+
+struct trajectory_footer
+{
+	static constexpr char magic_value[8] = {'P', 'S', 'I', 'M', 'T', 'I', 'D', 'X'};
+
+	uint64_t index_offset;
+	uint64_t num_frames;
+	char magic[8];
+};
+
+/* Quantizes and entropy codes frames into memory; independent of any file. */
+class trajectory_encoder
+{
+private:
+	double m_half_size;
+	uint32_t m_bits_per_axis;
+	std::vector<uint64_t> m_codes;
+
+public:
+	trajectory_encoder(const double &half_size, const double &precision);
+
+	uint32_t get_bits_per_axis() const
+	{
+		return m_bits_per_axis;
+	}
+
+	/* Replaces payload with the encoded frame. Throws, leaving payload untouched, if a position isn't finite. */
+	void encode(const vec3<double> *positions, const size_t &num, std::vector<uint8_t> &payload);
+
+	static void decode(const uint8_t *payload, const size_t &payload_size, const size_t &num,
+	                   const double &half_size, const uint32_t &bits_per_axis, std::vector<vec3<double>> &positions);
+};
+
+class trajectory_writer
+{
+private:
+	output_file m_file;
+	trajectory_encoder m_encoder;
+	std::vector<uint8_t> m_payload;
+	std::vector<trajectory_frame_info> m_index;
+	bool m_closed = false;
+
+public:
+	/* direct requests unbuffered I/O, see output_file. */
+	trajectory_writer(const std::string &path, const double &half_size, const double &precision, const bool &direct = false);
+	~trajectory_writer();
+
+	trajectory_writer(const trajectory_writer &) = delete;
+	trajectory_writer &operator=(const trajectory_writer &) = delete;
+
+	void write_frame(const vec3<double> *positions, const size_t &num, const uint64_t &step, const double &sim_time);
+
+	/* Appends an already encoded frame. */
+	void write_encoded_frame(const uint8_t *payload, const size_t &payload_size, const size_t &num, const uint64_t &step, const double &sim_time);
+
+	/* Writes the frame index and closes the file. Called by the destructor if needed. */
+	void close();
+
+	trajectory_encoder &get_encoder()
+	{
+		return m_encoder;
+	}
+};
+
+class trajectory_reader
+{
+private:
+	std::FILE *m_file = nullptr;
+	trajectory_file_header m_header;
+	std::vector<trajectory_frame_info> m_index;
+	std::vector<uint8_t> m_payload;
+
+public:
+	explicit trajectory_reader(const std::string &path);
+	~trajectory_reader();
+
+	trajectory_reader(const trajectory_reader &) = delete;
+	trajectory_reader &operator=(const trajectory_reader &) = delete;
+
+	size_t get_num_frames() const
+	{
+		return m_index.size();
+	}
+
+	const trajectory_frame_info &get_frame_info(const size_t &frame) const
+	{
+		return m_index[frame];
+	}
+
+	double get_precision() const
+	{
+		return m_header.precision;
+	}
+
+	void read_frame(const size_t &frame, std::vector<vec3<double>> &positions);
+};
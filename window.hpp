@@ -57,6 +57,12 @@ public:
 		glfwPollEvents();
 	}
 
+	/* Sleeps until an event arrives or timeout seconds pass. */
+	static void wait_events(const double &timeout)
+	{
+		glfwWaitEventsTimeout(timeout);
+	}
+
 	dimensions get_size() const
 	{
 		dimensions size;